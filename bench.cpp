@@ -0,0 +1,410 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <filesystem>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "caff.h"
+
+//Benchmark of the parser and the encoder of libcaff
+//  bench generate ciff|caff <file> [corpus options]       write one synthetic file
+//  bench [corpus options] [bench options] [files...]      measure on the given files, or on a synthetic CIFF and CAFF
+//Corpus options: --width N --height N --frames N --caption N --tags N --tag-size N --content noise|gradient|flat --seed N
+//Bench options: --iterations N --quality N --format jpg|png|bmp|tga|ppm
+//The results are printed as one JSON object per stage and one with the totals
+
+//Pixels of the synthetic images
+enum class PixelContent {
+	//Random bytes, the worst case of the JPEG encoder
+	noise,
+	//Smooth colour ramps, close to photographs
+	gradient,
+	//A single colour
+	flat
+};
+
+//Shape of the synthetic files
+struct CorpusOptions {
+	size_t width = 256;
+	size_t height = 256;
+	//Animation blocks of a CAFF
+	size_t frames = 10;
+	//Bytes of caption, without the '\n'
+	size_t captionSize = 16;
+	size_t tagCount = 4;
+	//Bytes of each tag, without the '\0'
+	size_t tagSize = 8;
+	PixelContent content = PixelContent::noise;
+	uint32_t seed = 1;
+};
+
+//Small and fast generator for the noise, the same seed gives the same files everywhere
+struct XorShift {
+	uint32_t state;
+
+	uint32_t next() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+};
+
+//Append an integer of bytes bytes in little-endian order, the byte order of the file formats
+void appendLittleEndian(std::vector<unsigned char>& out, uint64_t value, size_t bytes) {
+	for (size_t i = 0; i < bytes; i++) {
+		out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+	}
+}
+
+//Append a CAFF block header
+void appendBlockHeader(std::vector<unsigned char>& out, uint8_t id, uint64_t length) {
+	out.push_back(id);
+	appendLittleEndian(out, length, 8);
+}
+
+//Size of the CIFF of a frame
+size_t ciffSize(const CorpusOptions& options) {
+	return 36 + options.captionSize + 1 + options.tagCount * (options.tagSize + 1) + options.width * options.height * 3;
+}
+
+//Append a CIFF image, every frame of a CAFF gets different pixels
+void appendCIFF(std::vector<unsigned char>& out, const CorpusOptions& options, size_t frame) {
+	size_t content_size = options.width * options.height * 3;
+	size_t header_size = 36 + options.captionSize + 1 + options.tagCount * (options.tagSize + 1);
+	out.insert(out.end(), { 'C', 'I', 'F', 'F' });
+	appendLittleEndian(out, header_size, 8);
+	appendLittleEndian(out, content_size, 8);
+	appendLittleEndian(out, options.width, 8);
+	appendLittleEndian(out, options.height, 8);
+
+	//Caption and tags of lowercase letters
+	for (size_t i = 0; i < options.captionSize; i++) {
+		out.push_back(static_cast<unsigned char>('a' + (i + frame) % 26));
+	}
+	out.push_back('\n');
+	for (size_t tag = 0; tag < options.tagCount; tag++) {
+		for (size_t i = 0; i < options.tagSize; i++) {
+			out.push_back(static_cast<unsigned char>('a' + (tag + i) % 26));
+		}
+		out.push_back('\0');
+	}
+
+	XorShift random = { options.seed * 2654435761u + uint32_t(frame) + 1 };
+	size_t begin = out.size();
+	out.resize(begin + content_size);
+	unsigned char* pixels = out.data() + begin;
+	for (size_t y = 0; y < options.height; y++) {
+		for (size_t x = 0; x < options.width; x++) {
+			unsigned char* pixel = pixels + (y * options.width + x) * 3;
+			switch (options.content) {
+			case PixelContent::noise: {
+				uint32_t value = random.next();
+				pixel[0] = static_cast<unsigned char>(value);
+				pixel[1] = static_cast<unsigned char>(value >> 8);
+				pixel[2] = static_cast<unsigned char>(value >> 16);
+				break;
+			}
+			case PixelContent::gradient:
+				pixel[0] = static_cast<unsigned char>(x * 255 / std::max<size_t>(options.width - 1, 1));
+				pixel[1] = static_cast<unsigned char>(y * 255 / std::max<size_t>(options.height - 1, 1));
+				pixel[2] = static_cast<unsigned char>((x + y + frame * 8) & 0xFF);
+				break;
+			case PixelContent::flat:
+				pixel[0] = static_cast<unsigned char>(options.seed * 37 + frame);
+				pixel[1] = static_cast<unsigned char>(options.seed * 91);
+				pixel[2] = static_cast<unsigned char>(options.seed * 151);
+				break;
+			}
+		}
+	}
+}
+
+//A synthetic CIFF file
+std::vector<unsigned char> generateCIFF(const CorpusOptions& options) {
+	std::vector<unsigned char> out;
+	out.reserve(ciffSize(options));
+	appendCIFF(out, options, 0);
+	return out;
+}
+
+//A synthetic CAFF file with a credits block and options.frames animation blocks
+std::vector<unsigned char> generateCAFF(const CorpusOptions& options) {
+	static const char creator[] = "bench";
+	std::vector<unsigned char> out;
+	out.reserve(9 + 20 + 9 + 14 + sizeof(creator) - 1 + options.frames * (9 + 8 + ciffSize(options)));
+
+	appendBlockHeader(out, CAFFBlockType::header, 20);
+	out.insert(out.end(), { 'C', 'A', 'F', 'F' });
+	appendLittleEndian(out, 20, 8);
+	appendLittleEndian(out, options.frames, 8);
+
+	appendBlockHeader(out, CAFFBlockType::credits, 14 + sizeof(creator) - 1);
+	appendLittleEndian(out, 2024, 2);
+	out.insert(out.end(), { 1, 1, 12, 0 });
+	appendLittleEndian(out, sizeof(creator) - 1, 8);
+	out.insert(out.end(), creator, creator + sizeof(creator) - 1);
+
+	for (size_t frame = 0; frame < options.frames; frame++) {
+		appendBlockHeader(out, CAFFBlockType::animation, 8 + ciffSize(options));
+		appendLittleEndian(out, 40, 8);
+		appendCIFF(out, options, frame);
+	}
+	return out;
+}
+
+//One input of the benchmark
+struct BenchFile {
+	std::string name;
+	bool caff;
+	std::vector<unsigned char> data;
+};
+
+//Latencies of one stage of the benchmark
+struct StageTimes {
+	std::string name;
+	std::vector<double> microseconds;
+	//Bytes parsed or pixels encoded, for the throughput
+	double amount = 0;
+
+	void add(std::chrono::steady_clock::time_point start, double work) {
+		microseconds.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+		amount += work;
+	}
+};
+
+//Value below which the fraction p of the sorted latencies are
+double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t index = std::min(sorted.size() - 1, size_t(p * double(sorted.size())));
+	return sorted[index];
+}
+
+//Print the stage as a JSON object, the throughput is in unit per second
+void printStage(StageTimes& stage, const char* unit, double unitSize) {
+	std::sort(stage.microseconds.begin(), stage.microseconds.end());
+	double total = 0;
+	for (double time : stage.microseconds) {
+		total += time;
+	}
+	std::cout << "{\"stage\":\"" << stage.name << "\",\"count\":" << stage.microseconds.size() << ",\"ms\":" << total / 1000
+		<< ",\"" << unit << "_per_s\":" << (total > 0 ? stage.amount / unitSize / (total / 1e6) : 0)
+		<< ",\"p50_us\":" << percentile(stage.microseconds, 0.5) << ",\"p90_us\":" << percentile(stage.microseconds, 0.9)
+		<< ",\"p99_us\":" << percentile(stage.microseconds, 0.99)
+		<< ",\"max_us\":" << (stage.microseconds.empty() ? 0 : stage.microseconds.back()) << "}" << std::endl;
+}
+
+//Peak resident set size of the process in KiB, 0 where it is not known
+long peakRSS() {
+#ifndef _WIN32
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		return usage.ru_maxrss;
+	}
+#endif
+	return 0;
+}
+
+//Parse every file, then encode and split the tags of every frame, iterations times
+//Returns false if a file fails to parse or encode
+bool runBench(const std::vector<BenchFile>& files, size_t iterations, const EncodeOptions& encode) {
+	StageTimes parse = { "parse" };
+	StageTimes tags = { "tags" };
+	StageTimes encoding = { "encode" };
+	OutputBuffer output;
+	std::vector<std::string_view> tagViews;
+	std::vector<CIFFImage> images;
+	size_t outputBytes = 0;
+
+	for (size_t iteration = 0; iteration < iterations; iteration++) {
+		for (const BenchFile& file : files) {
+			//Parse the whole file, the frames are kept for the encoder
+			images.clear();
+			auto start = std::chrono::steady_clock::now();
+			CAFFError error = CAFFError::none;
+			if (file.caff) {
+				CAFFReader reader(file.data.data(), file.data.size());
+				CAFFHeader header;
+				error = reader.readHeader(header);
+				while (error == CAFFError::none && !reader.empty()) {
+					CAFFBlock block;
+					error = reader.next(block);
+					if (error == CAFFError::none && block.id == CAFFBlockType::animation) {
+						images.push_back(block.frame.image);
+					}
+				}
+				if (error == CAFFError::none) {
+					error = reader.finish();
+				}
+			}
+			else {
+				CIFFImage image;
+				error = parseCIFF(file.data.data(), file.data.size(), image);
+				images.push_back(image);
+			}
+			parse.add(start, double(file.data.size()));
+			if (error != CAFFError::none) {
+				std::cerr << file.name << ": " << caffErrorMessage(error) << std::endl;
+				return false;
+			}
+
+			for (const CIFFImage& image : images) {
+				start = std::chrono::steady_clock::now();
+				splitCIFFTags(image.tags, tagViews);
+				tags.add(start, double(image.tags.size()));
+
+				start = std::chrono::steady_clock::now();
+				error = encodeImage(image, encode, output);
+				encoding.add(start, double(image.width * image.height));
+				if (error != CAFFError::none) {
+					std::cerr << file.name << ": " << caffErrorMessage(error) << std::endl;
+					return false;
+				}
+				outputBytes += output.size();
+			}
+		}
+	}
+
+	printStage(parse, "mb", 1e6);
+	printStage(tags, "mb", 1e6);
+	printStage(encoding, "megapixels", 1e6);
+	std::cout << "{\"files\":" << files.size() << ",\"iterations\":" << iterations << ",\"output_bytes\":" << outputBytes
+		<< ",\"peak_rss_kb\":" << peakRSS() << "}" << std::endl;
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	CorpusOptions corpus;
+	EncodeOptions encode;
+	size_t iterations = 3;
+	std::vector<std::string> paths;
+	//generate mode: the type and the output file
+	bool generate = argc >= 2 && std::string(argv[1]) == "generate";
+	std::string generateType;
+	std::string generatePath;
+	int first = 1;
+	if (generate) {
+		if (argc < 4 || (std::string(argv[2]) != "ciff" && std::string(argv[2]) != "caff")) {
+			std::cerr << "Usage: bench generate ciff|caff <file> [options]" << std::endl;
+			return -1;
+		}
+		generateType = argv[2];
+		generatePath = argv[3];
+		first = 4;
+	}
+
+	for (int i = first; i < argc; i++) {
+		std::string option = argv[i];
+		//Every option but the file names takes a number, except --content and --format
+		if (option.rfind("--", 0) != 0) {
+			paths.push_back(option);
+			continue;
+		}
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value: " << option << std::endl;
+			return -1;
+		}
+		std::string value = argv[++i];
+		if (option == "--content") {
+			if (value == "noise") {
+				corpus.content = PixelContent::noise;
+			}
+			else if (value == "gradient") {
+				corpus.content = PixelContent::gradient;
+			}
+			else if (value == "flat") {
+				corpus.content = PixelContent::flat;
+			}
+			else {
+				std::cerr << "Invalid content: " << value << std::endl;
+				return -1;
+			}
+			continue;
+		}
+		if (option == "--format") {
+			const OutputFormat formats[] = { OutputFormat::jpg, OutputFormat::png, OutputFormat::bmp, OutputFormat::tga, OutputFormat::ppm };
+			const OutputFormat* format = std::find_if(std::begin(formats), std::end(formats), [&value](OutputFormat format) { return value == outputExtension(format); });
+			if (format == std::end(formats)) {
+				std::cerr << "Invalid output format: " << value << std::endl;
+				return -1;
+			}
+			encode.format = *format;
+			continue;
+		}
+		if (value.empty() || value.length() > 9 || value.find_first_not_of("0123456789") != std::string::npos) {
+			std::cerr << "Invalid value: " << option << " " << value << std::endl;
+			return -1;
+		}
+		size_t number = std::stoul(value);
+		if (option == "--width" && number > 0) {
+			corpus.width = number;
+		}
+		else if (option == "--height" && number > 0) {
+			corpus.height = number;
+		}
+		else if (option == "--frames" && number > 0) {
+			corpus.frames = number;
+		}
+		else if (option == "--caption") {
+			corpus.captionSize = number;
+		}
+		else if (option == "--tags") {
+			corpus.tagCount = number;
+		}
+		else if (option == "--tag-size") {
+			corpus.tagSize = number;
+		}
+		else if (option == "--seed") {
+			corpus.seed = uint32_t(number);
+		}
+		else if (option == "--iterations" && number > 0) {
+			iterations = number;
+		}
+		else if (option == "--quality" && number >= 1 && number <= 100) {
+			encode.quality = int(number);
+		}
+		else {
+			std::cerr << "Invalid option: " << option << " " << value << std::endl;
+			return -1;
+		}
+	}
+
+	if (generate) {
+		std::vector<unsigned char> data = generateType == "caff" ? generateCAFF(corpus) : generateCIFF(corpus);
+		std::ofstream file(generatePath, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+		if (!file.flush()) {
+			std::cerr << "Failed to write file: " << generatePath << std::endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	//The given files, or one synthetic file of each type
+	std::vector<BenchFile> files;
+	for (const std::string& path : paths) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			std::cerr << "Failed to open file: " << path << std::endl;
+			return -1;
+		}
+		std::string extension = std::filesystem::path(path).extension().string();
+		files.push_back({ path, extension == ".caff", std::vector<unsigned char>(std::istreambuf_iterator<char>(file), {}) });
+	}
+	if (files.empty()) {
+		files.push_back({ "synthetic.ciff", false, generateCIFF(corpus) });
+		files.push_back({ "synthetic.caff", true, generateCAFF(corpus) });
+	}
+	return runBench(files, iterations, encode) ? 0 : -1;
+}
@@ -0,0 +1,834 @@
+#include "caff.h"
+//caff.h has already included the declarations, this brings in the implementation
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CAFF_SSE2
+#endif
+#if defined(CAFF_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CAFF_AVX2
+#endif
+
+const char* caffErrorMessage(CAFFError error) {
+	switch (error) {
+	case CAFFError::none:
+		return "No error";
+	case CAFFError::truncated:
+		return "Not enough bytes left in the file!";
+	case CAFFError::blockHeader:
+		return "Id or length of CAFF block is not correct!";
+	case CAFFError::firstBlockNotHeader:
+		return "The first block was not a header block!";
+	case CAFFError::multipleHeaders:
+		return "Multiple Header Blocks in the file!";
+	case CAFFError::caffMagic:
+		return "Magic is not CAFF";
+	case CAFFError::caffHeaderSize:
+		return "Header size is not correct";
+	case CAFFError::noAnimations:
+		return "No CIFF image to convert!";
+	case CAFFError::animationCount:
+		return "Animation block count mismatch!";
+	case CAFFError::creditsDate:
+		return "Creation date is not correct!";
+	case CAFFError::creatorLength:
+		return "Creator length mismatch!";
+	case CAFFError::ciffMagic:
+		return "Magic is not CIFF";
+	case CAFFError::ciffHeaderSize:
+		return "Header size is incorrect";
+	case CAFFError::imageTooLarge:
+		return "Image dimensions are too large!";
+	case CAFFError::contentSize:
+		return "Content size is incorrect!";
+	case CAFFError::noPixels:
+		return "No pixels to make JPEG!";
+	case CAFFError::captionNotTerminated:
+		return "No closing '\\n' in caption!";
+	case CAFFError::tagNewline:
+		return "Tags contain '\\n' character!";
+	case CAFFError::encoding:
+		return "Failed to make JPEG file!";
+	}
+	return "Unknown error";
+}
+
+const char* caffErrorName(CAFFError error) {
+	switch (error) {
+	case CAFFError::none:
+		return "none";
+	case CAFFError::truncated:
+		return "truncated";
+	case CAFFError::blockHeader:
+		return "block_header";
+	case CAFFError::firstBlockNotHeader:
+		return "first_block_not_header";
+	case CAFFError::multipleHeaders:
+		return "multiple_headers";
+	case CAFFError::caffMagic:
+		return "caff_magic";
+	case CAFFError::caffHeaderSize:
+		return "caff_header_size";
+	case CAFFError::noAnimations:
+		return "no_animations";
+	case CAFFError::animationCount:
+		return "animation_count";
+	case CAFFError::creditsDate:
+		return "credits_date";
+	case CAFFError::creatorLength:
+		return "creator_length";
+	case CAFFError::ciffMagic:
+		return "ciff_magic";
+	case CAFFError::ciffHeaderSize:
+		return "ciff_header_size";
+	case CAFFError::imageTooLarge:
+		return "image_too_large";
+	case CAFFError::contentSize:
+		return "content_size";
+	case CAFFError::noPixels:
+		return "no_pixels";
+	case CAFFError::captionNotTerminated:
+		return "caption_not_terminated";
+	case CAFFError::tagNewline:
+		return "tag_newline";
+	case CAFFError::encoding:
+		return "encoding";
+	}
+	return "unknown";
+}
+
+CAFFError parseCAFFBlockHeader(ByteReader& reader, CAFFBlockHeader& block) {
+	StageTimer timer(StatsStage::blockHeader);
+	TraceScope trace("readCAFFBlockHeader");
+	countStat(StatsCounter::blocksParsed, 1);
+	//Check if there are 9 bytes to read in the file
+	if (!reader.canReadBytes(9)) {
+		return CAFFError::truncated;
+	}
+	//Decode the ID and length fields from the 9 bytes at once
+	const unsigned char* fields = reader.take(9);
+	block.id = fields[0];
+	block.length = loadLittleEndian<uint64_t>(fields + 1);
+	trace.setBytes(block.length);
+
+	//Check if it's a header block and the length is correctly 20 bytes (magic(4) + header_size(8) + num_anim(8))
+	if (block.id == CAFFBlockType::header && block.length == 20) {
+		return CAFFError::none;
+	}
+	//Check if it's a credits block and the length is at least 14 bytes (date(6) + creator_len(8))
+	if (block.id == CAFFBlockType::credits && block.length >= 14) {
+		return CAFFError::none;
+	}
+	//Check if it's an animation block and the length is at least 42 bytes (duration(8) + CIFF headers (36))
+	if (block.id == CAFFBlockType::animation && block.length >= 42) {
+		return CAFFError::none;
+	}
+	return CAFFError::blockHeader;
+}
+
+CAFFError parseCAFFHeaderBlock(ByteReader& reader, CAFFHeader& header) {
+	StageTimer timer(StatsStage::header);
+	//Check if we have enough space in the file to read
+	if (!reader.canReadBytes(20)) {
+		return CAFFError::truncated;
+	}
+	//Decode the header fields from the 20 bytes at once: magic(4), header_size(8), num_anim(8)
+	const unsigned char* fields = reader.take(20);
+	uint64_t header_size = loadLittleEndian<uint64_t>(fields + 4);
+	header.num_anim = loadLittleEndian<uint64_t>(fields + 12);
+
+	//Check if the magic characters are "CAFF"
+	if (std::memcmp(fields, "CAFF", 4) != 0) {
+		return CAFFError::caffMagic;
+	}
+	//Check if the header size is equal to 20 (magic(4) + header_size(8) + num_anim(8))
+	if (header_size != 20) {
+		return CAFFError::caffHeaderSize;
+	}
+	//Check if there are CIFFs to parse
+	if (header.num_anim < 1) {
+		return CAFFError::noAnimations;
+	}
+	return CAFFError::none;
+}
+
+CAFFError parseCAFFCreditsBlock(ByteReader& reader, size_t credits_length, CAFFCredits& credits) {
+	StageTimer timer(StatsStage::header);
+	//Check if the file has enough data to read for the credits
+	if (credits_length < 14 || !reader.canReadBytes(credits_length)) {
+		return CAFFError::truncated;
+	}
+	//Decode the date and the creator length from the 14 bytes at once
+	const unsigned char* fields = reader.take(14);
+	credits.year = loadLittleEndian<uint16_t>(fields);
+	credits.month = fields[2];
+	credits.day = fields[3];
+	credits.hour = fields[4];
+	credits.minute = fields[5];
+	uint64_t creator_length = loadLittleEndian<uint64_t>(fields + 6);
+
+	//Check if the date format is correct
+	if (credits.year > 9999 || credits.month < 1 || credits.month > 12 || credits.day < 1 || credits.day > 31 || credits.hour > 24 || credits.minute > 60) {
+		return CAFFError::creditsDate;
+	}
+	//Check if the creator matches up with the CAFF block length
+	if (creator_length != credits_length - 14) {
+		return CAFFError::creatorLength;
+	}
+	//The creator string is read straight from the file data
+	credits.creator = std::string_view(reinterpret_cast<const char*>(reader.take(creator_length)), creator_length);
+	return CAFFError::none;
+}
+
+//Index of the lowest set bit of a non-zero mask
+static unsigned lowestBit(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long bit;
+	_BitScanForward(&bit, mask);
+	return unsigned(bit);
+#else
+	return unsigned(__builtin_ctz(mask));
+#endif
+}
+
+//A pass over the caption and the tags of a CIFF header that is handed the '\n' and '\0' bytes 16 or 32 at a time
+struct CIFFTextScan {
+	const char* text;
+	//Until the caption is closed by the first '\n' its '\0' bytes are not tag ends
+	bool inCaption;
+	size_t captionLength;
+	//Offset of the first character of the next tag
+	size_t tagStart;
+	//The tags go here, nullptr if they are only checked
+	std::vector<std::string_view>* tags;
+
+	//Take the bytes at offset, bit i of the masks stands for the byte at offset + i
+	//Returns false at a '\n' in the tags, the rest of the text doesn't need to be read
+	bool add(size_t offset, uint32_t newlines, uint32_t zeros) {
+		if (inCaption) {
+			if (newlines == 0) {
+				return true;
+			}
+			unsigned bit = lowestBit(newlines);
+			captionLength = offset + bit;
+			tagStart = captionLength + 1;
+			inCaption = false;
+			//Drop the bits of the caption and its '\n'
+			uint32_t after = ~((2u << bit) - 1);
+			newlines &= after;
+			zeros &= after;
+		}
+		if (newlines != 0) {
+			return false;
+		}
+		if (tags != nullptr) {
+			for (; zeros != 0; zeros &= zeros - 1) {
+				size_t end = offset + lowestBit(zeros);
+				tags->emplace_back(text + tagStart, end - tagStart);
+				tagStart = end + 1;
+			}
+		}
+		return true;
+	}
+};
+
+#ifdef CAFF_AVX2
+__attribute__((target("avx2"))) static bool scanCIFFTextAVX2(CIFFTextScan& scan, size_t size, bool newlines, size_t& i) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i newlineMask = _mm256_set1_epi8(newlines ? -1 : 0);
+	const __m256i zeroMask = _mm256_set1_epi8(scan.tags != nullptr ? -1 : 0);
+	//Two vectors at a time, most of them hold neither byte in a long caption or tag
+	for (; i + 64 <= size; i += 64) {
+		__m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scan.text + i));
+		__m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scan.text + i + 32));
+		__m256i zeros[2] = { _mm256_and_si256(_mm256_cmpeq_epi8(low, zero), zeroMask), _mm256_and_si256(_mm256_cmpeq_epi8(high, zero), zeroMask) };
+		__m256i newlineBytes[2] = { _mm256_and_si256(_mm256_cmpeq_epi8(low, newline), newlineMask), _mm256_and_si256(_mm256_cmpeq_epi8(high, newline), newlineMask) };
+		__m256i found = _mm256_or_si256(_mm256_or_si256(zeros[0], zeros[1]), _mm256_or_si256(newlineBytes[0], newlineBytes[1]));
+		if (_mm256_testz_si256(found, found)) {
+			continue;
+		}
+		for (int half = 0; half < 2; half++) {
+			if (!scan.add(i + 32 * half, uint32_t(_mm256_movemask_epi8(newlineBytes[half])), uint32_t(_mm256_movemask_epi8(zeros[half])))) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+#endif
+
+//Run the scan over size bytes of text in one pass, the '\n' bytes are ignored unless newlines is set
+//and the '\0' bytes unless the tags are split, so a vector with neither costs a compare and a test
+//Returns false at a '\n' in the tags
+static bool scanCIFFText(CIFFTextScan& scan, size_t size, bool newlines) {
+	const char* text = scan.text;
+	size_t i = 0;
+#ifdef CAFF_AVX2
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if (avx2 && !scanCIFFTextAVX2(scan, size, newlines, i)) {
+		return false;
+	}
+#endif
+#ifdef CAFF_SSE2
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i newlineMask = _mm_set1_epi8(newlines ? -1 : 0);
+	const __m128i zeroMask = _mm_set1_epi8(scan.tags != nullptr ? -1 : 0);
+	for (; i + 16 <= size; i += 16) {
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+		__m128i zeros = _mm_and_si128(_mm_cmpeq_epi8(bytes, zero), zeroMask);
+		__m128i newlineBytes = _mm_and_si128(_mm_cmpeq_epi8(bytes, newline), newlineMask);
+		if (_mm_movemask_epi8(_mm_or_si128(zeros, newlineBytes)) == 0) {
+			continue;
+		}
+		if (!scan.add(i, uint32_t(_mm_movemask_epi8(newlineBytes)), uint32_t(_mm_movemask_epi8(zeros)))) {
+			return false;
+		}
+	}
+#endif
+	//The bytes after the last full vector, the characters after the last '\0' are not a tag
+	for (; i < size; i++) {
+		if (!scan.add(i, newlines && text[i] == '\n', scan.tags != nullptr && text[i] == '\0')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+CAFFError parseCIFF(ByteReader& reader, CIFFImage& image, std::vector<std::string_view>* tags) {
+	StageTimer timer(StatsStage::header);
+	//Check if the file has enough data to read the CIFF headers
+	if (!reader.canReadBytes(36)) {
+		return CAFFError::truncated;
+	}
+	//Decode the header fields from the 36 bytes at once: magic(4), header_size(8), content_size(8), width(8), height(8)
+	const unsigned char* fields = reader.take(36);
+	uint64_t header_size = loadLittleEndian<uint64_t>(fields + 4);
+	image.content_size = loadLittleEndian<uint64_t>(fields + 12);
+	image.width = loadLittleEndian<uint64_t>(fields + 20);
+	image.height = loadLittleEndian<uint64_t>(fields + 28);
+
+	//Check if magic characters are CIFF
+	if (std::memcmp(fields, "CIFF", 4) != 0) {
+		return CAFFError::ciffMagic;
+	}
+	//Check if the header size has room for at least the ending characters of the caption and the tags
+	if (header_size < 38) {
+		return CAFFError::ciffHeaderSize;
+	}
+	//Check that width * height * 3 does not overflow, the encoder reads that many bytes from the file data
+	if (image.width != 0 && image.height > SIZE_MAX / 3 / image.width) {
+		return CAFFError::imageTooLarge;
+	}
+	//Check if the Content size is width * height * 3
+	if (image.content_size != image.width * image.height * 3) {
+		return CAFFError::contentSize;
+	}
+	//Check if there are pixels to convert
+	if (image.content_size == 0) {
+		return CAFFError::noPixels;
+	}
+
+	//Calculate the remaining size of the header
+	size_t remaining_header_size = header_size - 36;
+	if (!reader.canReadBytes(remaining_header_size)) {
+		return CAFFError::truncated;
+	}
+	//The caption and the tags are read straight from the file data
+	const char* header_text = reinterpret_cast<const char*>(reader.take(remaining_header_size));
+
+	//The caption ends at the first '\n', the rest of the space is for the tags
+	//One pass finds it, checks that the tags have no '\n' in them and splits them if asked to
+	if (tags != nullptr) {
+		tags->clear();
+	}
+	CIFFTextScan scan = { header_text, true, 0, 0, tags };
+	bool tagsValid = scanCIFFText(scan, remaining_header_size, true);
+	if (scan.inCaption) {
+		return CAFFError::captionNotTerminated;
+	}
+	if (!tagsValid) {
+		return CAFFError::tagNewline;
+	}
+	image.caption = std::string_view(header_text, scan.captionLength);
+	image.tags = std::string_view(header_text + scan.captionLength + 1, remaining_header_size - scan.captionLength - 1);
+
+	//Check if the file has enough space for the pixels
+	if (!reader.canReadBytes(image.content_size)) {
+		return CAFFError::truncated;
+	}
+	//The pixels are handed out straight from the file data
+	image.pixels = reader.take(image.content_size);
+	return CAFFError::none;
+}
+
+CAFFError parseCIFF(const unsigned char* data, size_t size, CIFFImage& image, std::vector<std::string_view>* tags) {
+	TraceScope trace("readCIFF", 0, size);
+	ByteReader reader(data, size);
+	return parseCIFF(reader, image, tags);
+}
+
+CAFFError parseCAFFAnimationBlock(ByteReader& reader, size_t animation_length, CAFFFrame& frame, std::vector<std::string_view>* tags) {
+	//Check if the file has enough data to read the block
+	if (animation_length < 8 || !reader.canReadBytes(animation_length)) {
+		return CAFFError::truncated;
+	}
+	//Decode the duration
+	frame.duration = loadLittleEndian<uint64_t>(reader.take(8));
+
+	//Read and verify the CIFF file
+	return parseCIFF(reader, frame.image, tags);
+}
+
+void splitCIFFTags(std::string_view text, std::vector<std::string_view>& tags) {
+	tags.clear();
+	CIFFTextScan scan = { text.data(), false, 0, 0, &tags };
+	scanCIFFText(scan, text.size(), false);
+}
+
+bool nextCIFFTag(std::string_view& tags, std::string_view& tag) {
+	size_t end = tags.find('\0');
+	if (end == std::string_view::npos) {
+		return false;
+	}
+	tag = tags.substr(0, end);
+	tags.remove_prefix(end + 1);
+	return true;
+}
+
+CAFFError CAFFReader::readHeader(CAFFHeader& header) {
+	//Read the first block header
+	CAFFBlockHeader block;
+	CAFFError error = parseCAFFBlockHeader(reader, block);
+	if (error != CAFFError::none) {
+		return error;
+	}
+	//Check if the first block is a header block
+	if (block.id != CAFFBlockType::header) {
+		return CAFFError::firstBlockNotHeader;
+	}
+	if (!reader.canReadBytes(block.length)) {
+		return CAFFError::truncated;
+	}
+	ByteReader headerBlock = reader.split(block.length);
+	error = parseCAFFHeaderBlock(headerBlock, header);
+	num_anim = header.num_anim;
+	return error;
+}
+
+CAFFError CAFFReader::next(CAFFBlock& block, std::vector<std::string_view>* tags) {
+	//Read the current CAFF block header
+	CAFFBlockHeader header;
+	CAFFError error = parseCAFFBlockHeader(reader, header);
+	if (error != CAFFError::none) {
+		return error;
+	}
+	//Every block is parsed from its own reader, so a block can't read into the next one
+	if (!reader.canReadBytes(header.length)) {
+		return CAFFError::truncated;
+	}
+	ByteReader data = reader.split(header.length);
+	block.id = header.id;
+
+	switch (header.id) {
+	case CAFFBlockType::header:
+		return CAFFError::multipleHeaders;
+	case CAFFBlockType::credits:
+		return parseCAFFCreditsBlock(data, header.length, block.credits);
+	default: {
+		//More animation blocks than announced in the header
+		if (frame >= num_anim) {
+			return CAFFError::animationCount;
+		}
+		TraceScope trace("readCIFF", int64_t(frame), header.length);
+		frame++;
+		return parseCAFFAnimationBlock(data, header.length, block.frame, tags);
+	}
+	}
+}
+
+CAFFError CAFFReader::finish() const {
+	return frame == num_anim ? CAFFError::none : CAFFError::animationCount;
+}
+
+CAFFError indexCAFFBlocks(const unsigned char* data, size_t size, std::vector<CAFFBlockIndexEntry>& index) {
+	ByteReader reader(data, size);
+	index.clear();
+	do {
+		//Read the current CAFF block header
+		CAFFBlockHeader block;
+		CAFFError error = parseCAFFBlockHeader(reader, block);
+		if (error != CAFFError::none) {
+			return error;
+		}
+		//Skip the block data
+		if (!reader.canReadBytes(block.length)) {
+			return CAFFError::truncated;
+		}
+		index.push_back({ reader.position(), block.length, block.id, {} });
+		reader.take(block.length);
+	} while (!reader.empty());
+	return CAFFError::none;
+}
+
+void OutputBuffer::append(const void* data, size_t size) {
+	//Grow geometrically, so appending an image in small chunks is amortised constant time
+	if (size > bytes.size() - length) {
+		bytes.resize(std::max(bytes.size() * 2, length + size));
+	}
+	std::memcpy(bytes.data() + length, data, size);
+	length += size;
+}
+
+void OutputBuffer::write(void* context, void* data, int size) {
+	static_cast<OutputBuffer*>(context)->append(data, size_t(size));
+}
+
+const char* outputExtension(OutputFormat format) {
+	switch (format) {
+	case OutputFormat::png:
+		return "png";
+	case OutputFormat::bmp:
+		return "bmp";
+	case OutputFormat::tga:
+		return "tga";
+	case OutputFormat::ppm:
+		return "ppm";
+	default:
+		return "jpg";
+	}
+}
+
+JPEGEncoder::JPEGEncoder(int quality, ChromaSubsampling subsampling, bool optimizeHuffman, bool integerDCT) {
+	int subsample = subsampling == ChromaSubsampling::yuv420 ? 1 : subsampling == ChromaSubsampling::yuv444 ? 0 : -1;
+	stbi_write_jpg_context_init_ex(&tables, quality, subsample);
+	tables.optimize_huffman = optimizeHuffman;
+	tables.integer_dct = integerDCT;
+}
+
+CAFFError JPEGEncoder::encode(const CIFFImage& image, OutputBuffer& output) const {
+	output.clear();
+	//stb takes the dimensions as int
+	if (image.width > INT_MAX || image.height > INT_MAX) {
+		return CAFFError::encoding;
+	}
+	TraceScope trace("stbi_write_jpg");
+	JPEGStageTimers timers;
+	if (stbi_write_jpg_stats_to_func_ctx(&OutputBuffer::write, &output, int(image.width), int(image.height), 3, image.pixels, nullptr, nullptr, 0, 0, &tables, timers.get()) == 0) {
+		return CAFFError::encoding;
+	}
+	trace.setBytes(output.size());
+	return CAFFError::none;
+}
+
+size_t JPEGEncoder::bandHeight(size_t width, size_t height, unsigned threadCount) const {
+	//Smallest band worth a thread
+	const size_t minBandPixels = size_t(1) << 18;
+	if (threadCount < 2 || tables.optimize_huffman || width == 0 || width > INT_MAX || height > INT_MAX) {
+		return 0;
+	}
+	//A few bands per thread even out the bands that take longer, 16 rows are an MCU row with any subsampling
+	size_t bandHeight = std::max((height + threadCount * 4 - 1) / (threadCount * 4), (minBandPixels + width - 1) / width);
+	bandHeight = (bandHeight + 15) / 16 * 16;
+	//The MCUs of a band are one restart interval, which is 16 bits (counted with the 8x8 MCUs of 4:4:4)
+	size_t maxBandHeight = 65535 / ((width + 7) / 8) * 8 / 16 * 16;
+	bandHeight = std::min(bandHeight, maxBandHeight);
+	return bandHeight >= height ? 0 : bandHeight;
+}
+
+CAFFError JPEGEncoder::encodeParallel(const CIFFImage& image, OutputBuffer& output, unsigned threadCount) const {
+	size_t bandHeight = this->bandHeight(image.width, image.height, threadCount);
+	if (bandHeight == 0) {
+		return encode(image, output);
+	}
+
+	//Every band is encoded into its own buffer, then they are joined in order
+	size_t bandCount = (image.height + bandHeight - 1) / bandHeight;
+	std::vector<OutputBuffer> bands(bandCount);
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+	auto work = [&]() {
+		for (size_t band = next++; band < bandCount; band = next++) {
+			//The stages of a band are added to the stats of the thread that encoded it
+			TraceScope trace("stbi_write_jpg_band");
+			JPEGStageTimers timers;
+			if (stbi_write_jpg_stats_to_func_ctx(&OutputBuffer::write, &bands[band], int(image.width), int(image.height), 3, image.pixels,
+				nullptr, nullptr, int(band * bandHeight), int(bandHeight), &tables, timers.get()) == 0) {
+				failed = true;
+			}
+			trace.setBytes(bands[band].size());
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < std::min<size_t>(threadCount, bandCount); i++) {
+		workers.emplace_back(work);
+	}
+	work();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+
+	output.clear();
+	if (failed) {
+		return CAFFError::encoding;
+	}
+	for (const OutputBuffer& band : bands) {
+		output.append(band.data(), band.size());
+	}
+	return CAFFError::none;
+}
+
+const JPEGEncoder& jpegEncoder(int quality, ChromaSubsampling subsampling, bool optimizeHuffman, bool integerDCT) {
+	static std::once_flag made[2][2][3][101];
+	static std::unique_ptr<JPEGEncoder> encoders[2][2][3][101];
+	//Above 90 stb turns chroma subsampling off, which 100 does as well
+	quality = quality == 0 ? 90 : std::clamp(quality, 1, 100);
+	size_t mode = size_t(subsampling);
+	std::unique_ptr<JPEGEncoder>& encoder = encoders[integerDCT][optimizeHuffman][mode][quality];
+	std::call_once(made[integerDCT][optimizeHuffman][mode][quality], [&encoder, quality, subsampling, optimizeHuffman, integerDCT] {
+		encoder = std::make_unique<JPEGEncoder>(quality, subsampling, optimizeHuffman, integerDCT);
+	});
+	return *encoder;
+}
+
+CAFFError encodeJPEG(const CIFFImage& image, int quality, OutputBuffer& output) {
+	return jpegEncoder(quality).encode(image, output);
+}
+
+std::string_view ppmHeader(size_t width, size_t height, char (&buffer)[64]) {
+	int length = snprintf(buffer, sizeof(buffer), "P6\n%zu %zu\n255\n", width, height);
+	return std::string_view(buffer, size_t(length));
+}
+
+CAFFError encodeImage(const CIFFImage& image, const EncodeOptions& options, OutputBuffer& output) {
+	output.clear();
+	if (options.format == OutputFormat::ppm) {
+		char buffer[64];
+		std::string_view header = ppmHeader(image.width, image.height, buffer);
+		output.append(header.data(), header.size());
+		output.append(image.pixels, image.content_size);
+		return CAFFError::none;
+	}
+	if (options.format == OutputFormat::jpg) {
+		return jpegEncoder(options.quality, options.subsampling, options.optimizeHuffman, options.integerDCT).encodeParallel(image, output, options.threads);
+	}
+	//stb takes the dimensions as int, and the PNG stride too
+	if (image.width > INT_MAX / 3 || image.height > INT_MAX) {
+		return CAFFError::encoding;
+	}
+	int width = int(image.width);
+	int height = int(image.height);
+	int result = 0;
+	switch (options.format) {
+	case OutputFormat::png:
+		result = stbi_write_png_to_func(&OutputBuffer::write, &output, width, height, 3, image.pixels, width * 3);
+		break;
+	case OutputFormat::bmp:
+		result = stbi_write_bmp_to_func(&OutputBuffer::write, &output, width, height, 3, image.pixels);
+		break;
+	default:
+		result = stbi_write_tga_to_func(&OutputBuffer::write, &output, width, height, 3, image.pixels);
+		break;
+	}
+	return result != 0 ? CAFFError::none : CAFFError::encoding;
+}
+
+bool statsEnabled = false;
+
+const char* statsStageName(StatsStage stage) {
+	switch (stage) {
+	case StatsStage::blockHeader:
+		return "block_header";
+	case StatsStage::header:
+		return "header";
+	case StatsStage::pixelRead:
+		return "pixel_read";
+	case StatsStage::colorConversion:
+		return "color_conversion";
+	case StatsStage::dct:
+		return "dct";
+	case StatsStage::huffman:
+		return "huffman";
+	case StatsStage::encode:
+		return "encode";
+	case StatsStage::fileWrite:
+		return "file_write";
+	default:
+		return "unknown";
+	}
+}
+
+const char* statsCounterName(StatsCounter counter) {
+	switch (counter) {
+	case StatsCounter::files:
+		return "files";
+	case StatsCounter::bytesRead:
+		return "bytes_read";
+	case StatsCounter::blocksParsed:
+		return "blocks_parsed";
+	case StatsCounter::imagesEncoded:
+		return "images_encoded";
+	case StatsCounter::mcusEncoded:
+		return "mcus_encoded";
+	case StatsCounter::outputBytes:
+		return "output_bytes";
+	case StatsCounter::cacheHits:
+		return "cache_hits";
+	case StatsCounter::cacheMisses:
+		return "cache_misses";
+	default:
+		return "unknown";
+	}
+}
+
+void ConversionStats::add(const ConversionStats& other) {
+	for (size_t i = 0; i < size_t(StatsStage::count); i++) {
+		nanoseconds[i] += other.nanoseconds[i];
+		calls[i] += other.calls[i];
+	}
+	for (size_t i = 0; i < size_t(StatsCounter::count); i++) {
+		counters[i] += other.counters[i];
+	}
+}
+
+ConversionStats ConversionStats::since(const ConversionStats& earlier) const {
+	ConversionStats difference;
+	for (size_t i = 0; i < size_t(StatsStage::count); i++) {
+		difference.nanoseconds[i] = nanoseconds[i] - earlier.nanoseconds[i];
+		difference.calls[i] = calls[i] - earlier.calls[i];
+	}
+	for (size_t i = 0; i < size_t(StatsCounter::count); i++) {
+		difference.counters[i] = counters[i] - earlier.counters[i];
+	}
+	return difference;
+}
+
+uint64_t statsClock() {
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//Stats of the running threads, and the sum of the stats of the threads that have exited
+static std::mutex statsMutex;
+static std::vector<const ConversionStats*> runningStats;
+static ConversionStats exitedStats;
+
+//Stats of a thread, known to collectStats() from the first time the thread uses them
+struct ThreadStats {
+	ConversionStats stats;
+
+	ThreadStats() {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		runningStats.push_back(&stats);
+	}
+	~ThreadStats() {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		exitedStats.add(stats);
+		runningStats.erase(std::find(runningStats.begin(), runningStats.end(), &stats));
+	}
+};
+
+ConversionStats& threadStats() {
+	thread_local ThreadStats thread;
+	return thread.stats;
+}
+
+ConversionStats collectStats() {
+	std::lock_guard<std::mutex> lock(statsMutex);
+	ConversionStats total = exitedStats;
+	for (const ConversionStats* stats : runningStats) {
+		total.add(*stats);
+	}
+	return total;
+}
+
+//stbi_write_jpg_stats clock, the encoder stages are timed in nanoseconds like the others
+static unsigned long long jpegStatsClock() {
+	return statsClock();
+}
+
+void JPEGStageTimers::start() {
+	timers = {};
+	timers.clock = &jpegStatsClock;
+}
+
+void JPEGStageTimers::finish() {
+	ConversionStats& stats = threadStats();
+	const std::pair<StatsStage, unsigned long long> stages[] = {
+		{ StatsStage::pixelRead, timers.read_time },
+		{ StatsStage::colorConversion, timers.color_time },
+		{ StatsStage::dct, timers.dct_time },
+		{ StatsStage::huffman, timers.huffman_time }
+	};
+	for (const auto& stage : stages) {
+		stats.nanoseconds[size_t(stage.first)] += stage.second;
+		stats.calls[size_t(stage.first)]++;
+	}
+	stats.counters[size_t(StatsCounter::mcusEncoded)] += timers.mcus;
+}
+
+bool traceEnabled = false;
+
+//Events a thread keeps, a power of two
+static const size_t traceRingSize = size_t(1) << 16;
+
+//Trace events of one thread
+//written only grows, the event of number n is at n % traceRingSize
+struct TraceRing {
+	uint32_t thread;
+	std::unique_ptr<TraceEvent[]> events;
+	std::atomic<uint64_t> written;
+};
+
+//The rings of every thread that has traced anything, they outlive their threads
+static std::mutex traceMutex;
+static std::vector<std::unique_ptr<TraceRing>> traceRings;
+
+//Ring of the calling thread, made the first time the thread records an event
+static TraceRing& threadTraceRing() {
+	thread_local TraceRing* ring = nullptr;
+	if (ring == nullptr) {
+		std::unique_ptr<TraceRing> made(new TraceRing());
+		made->events.reset(new TraceEvent[traceRingSize]);
+		made->written = 0;
+		std::lock_guard<std::mutex> lock(traceMutex);
+		made->thread = uint32_t(traceRings.size() + 1);
+		ring = made.get();
+		traceRings.push_back(std::move(made));
+	}
+	return *ring;
+}
+
+void recordTraceEvent(const TraceEvent& event) {
+	TraceRing& ring = threadTraceRing();
+	uint64_t number = ring.written.load(std::memory_order_relaxed);
+	TraceEvent& slot = ring.events[number & (traceRingSize - 1)];
+	slot = event;
+	slot.thread = ring.thread;
+	ring.written.store(number + 1, std::memory_order_release);
+}
+
+size_t collectTrace(std::vector<TraceEvent>& events) {
+	events.clear();
+	size_t overwritten = 0;
+	std::lock_guard<std::mutex> lock(traceMutex);
+	for (const std::unique_ptr<TraceRing>& ring : traceRings) {
+		uint64_t written = ring->written.load(std::memory_order_acquire);
+		uint64_t first = written > traceRingSize ? written - traceRingSize : 0;
+		overwritten += size_t(first);
+		for (uint64_t number = first; number < written; number++) {
+			events.push_back(ring->events[number & (traceRingSize - 1)]);
+		}
+	}
+	return overwritten;
+}
@@ -0,0 +1,499 @@
+#pragma once
+//CAFF and CIFF parsing library
+//Every function takes a span of bytes and fills plain structs, the strings and the pixels of the results
+//point into the input bytes, so they stay valid as long as the input does
+//Nothing is printed and parsing allocates nothing, errors are reported as CAFFError values
+//Images are encoded into OutputBuffers, which keep their memory between images
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include "stb_image_write.h"
+
+//Reasons a file can be rejected
+enum class CAFFError {
+	none,
+	//A field or block runs past the end of the data
+	truncated,
+	//The id of a block is unknown or its length doesn't fit the block type
+	blockHeader,
+	//The first block of a CAFF is not a header block
+	firstBlockNotHeader,
+	//There is more than one header block in a CAFF
+	multipleHeaders,
+	//The magic of the CAFF header is not "CAFF"
+	caffMagic,
+	//The header size field of the CAFF header is not 20
+	caffHeaderSize,
+	//The CAFF header announces no animation blocks
+	noAnimations,
+	//The number of animation blocks doesn't match the CAFF header
+	animationCount,
+	//The creation date of the credits is out of range
+	creditsDate,
+	//The creator length doesn't match the length of the credits block
+	creatorLength,
+	//The magic of the CIFF header is not "CIFF"
+	ciffMagic,
+	//The header size of a CIFF is too small for the caption and the tags
+	ciffHeaderSize,
+	//width * height * 3 doesn't fit in a size_t
+	imageTooLarge,
+	//The content size of a CIFF is not width * height * 3
+	contentSize,
+	//The CIFF has no pixels
+	noPixels,
+	//The caption of a CIFF has no closing '\n'
+	captionNotTerminated,
+	//The tags of a CIFF contain a '\n'
+	tagNewline,
+	//The image could not be encoded
+	encoding
+};
+
+//Human readable description of an error
+const char* caffErrorMessage(CAFFError error);
+//Name of an error in machine readable reports, the enumerator in snake_case
+const char* caffErrorName(CAFFError error);
+
+struct CAFFBlockType {
+public:
+	static const uint8_t header = '\x01';
+	static const uint8_t credits = '\x02';
+	static const uint8_t animation = '\x03';
+};
+
+struct CAFFBlockHeader {
+	uint8_t id;
+	size_t length;
+};
+
+//Position of a CAFF block in the file
+//Fixed size fields, this is also the layout of the entries in the sidecar index file
+struct CAFFBlockIndexEntry {
+	//Offset of the block data (right after the block header) from the start of the file
+	uint64_t offset;
+	uint64_t length;
+	uint8_t id;
+	uint8_t reserved[7];
+};
+
+//Data of the CAFF header block
+struct CAFFHeader {
+	//Number of animation blocks in the file
+	size_t num_anim;
+};
+
+//Data of a CAFF credits block
+struct CAFFCredits {
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hour;
+	uint8_t minute;
+	std::string_view creator;
+};
+
+//Metadata and pixels of a CIFF image
+struct CIFFImage {
+	size_t width;
+	size_t height;
+	//Caption without the closing '\n'
+	std::string_view caption;
+	//The tags, each of them closed by a '\0', use nextCIFFTag to go through them
+	std::string_view tags;
+	//width * height RGB pixels, row by row
+	const unsigned char* pixels;
+	size_t content_size;
+};
+
+//Data of a CAFF animation block
+struct CAFFFrame {
+	//Display time of the frame in milliseconds
+	size_t duration;
+	CIFFImage image;
+};
+
+//Load a little-endian integer of sizeof(T) bytes, every integer of the file formats is stored this way
+//A plain unaligned copy, the bytes are only swapped on big-endian machines
+template <typename T>
+T loadLittleEndian(const unsigned char* data) {
+	T value;
+	std::memcpy(&value, data, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	T swapped = 0;
+	for (size_t i = 0; i < sizeof(T); i++) {
+		swapped = T((swapped << 8) | (value & 0xFF));
+		value = T(value >> 8);
+	}
+	value = swapped;
+#endif
+	return value;
+}
+
+//Cursor over a span of bytes, usually a MappedFile
+//Bounds checks are pointer arithmetic against the end of the span, reads are plain copies
+class ByteReader {
+public:
+	ByteReader(const unsigned char* data, size_t size) : begin(data), current(data), end(data + size) {}
+
+	//Method to check if the span still has enough bytes to read
+	bool canReadBytes(size_t numBytes) const {
+		return numBytes <= size_t(end - current);
+	}
+	//Read a fixed size field, the caller has to check canReadBytes first
+	template <typename T>
+	void read(T& value) {
+		std::memcpy(&value, current, sizeof(value));
+		current += sizeof(value);
+	}
+	//Return a pointer to the next numBytes bytes and move past them, the caller has to check canReadBytes first
+	const unsigned char* take(size_t numBytes) {
+		const unsigned char* data = current;
+		current += numBytes;
+		return data;
+	}
+	//Split the next numBytes bytes off into their own reader and move past them, the caller has to check canReadBytes first
+	ByteReader split(size_t numBytes) {
+		return ByteReader(take(numBytes), numBytes);
+	}
+	//Check if every byte has been read
+	bool empty() const {
+		return current == end;
+	}
+	//Number of bytes read so far
+	size_t position() const {
+		return size_t(current - begin);
+	}
+
+private:
+	const unsigned char* begin;
+	const unsigned char* current;
+	const unsigned char* end;
+};
+
+//Read a CAFF block header (id and length) and check that the length fits the block type
+CAFFError parseCAFFBlockHeader(ByteReader& reader, CAFFBlockHeader& block);
+//Read and check the data of a CAFF header block
+CAFFError parseCAFFHeaderBlock(ByteReader& reader, CAFFHeader& header);
+//Read and check the data of a CAFF credits block of credits_length bytes
+CAFFError parseCAFFCreditsBlock(ByteReader& reader, size_t credits_length, CAFFCredits& credits);
+//Read and check a CIFF image, the pixels are not read, only their place is checked
+//The caption and the tags are read in one pass, 16 or 32 bytes at a time with SSE2 or AVX2
+//With tags the tags are split into it in the same pass, like calling nextCIFFTag until it returns false
+CAFFError parseCIFF(ByteReader& reader, CIFFImage& image, std::vector<std::string_view>* tags = nullptr);
+//Read and check a CIFF file
+CAFFError parseCIFF(const unsigned char* data, size_t size, CIFFImage& image, std::vector<std::string_view>* tags = nullptr);
+//Read and check the data of a CAFF animation block of animation_length bytes
+CAFFError parseCAFFAnimationBlock(ByteReader& reader, size_t animation_length, CAFFFrame& frame, std::vector<std::string_view>* tags = nullptr);
+
+//Take the next tag off the front of the tags of a CIFF image
+//Returns false when there are no more tags, the characters after the last '\0' are not a tag
+bool nextCIFFTag(std::string_view& tags, std::string_view& tag);
+//Split the tags of a CIFF image into views of the input in one pass, like calling nextCIFFTag until it returns false
+//The '\0' bytes are found 16 or 32 at a time with SSE2 or AVX2, so many short tags cost no more than a few long ones
+//tags is cleared first, so it can be reused; parseCIFF splits them while it checks them, which saves reading them again
+void splitCIFFTags(std::string_view text, std::vector<std::string_view>& tags);
+
+//One credits or animation block of a CAFF, only the member matching the id is filled
+struct CAFFBlock {
+	uint8_t id;
+	CAFFCredits credits;
+	CAFFFrame frame;
+};
+
+//Walks the blocks of a CAFF file front to back
+//readHeader has to be called first, then next until the blocks run out (or the wanted frame is found)
+//and finish checks that the number of animation blocks matches the header
+class CAFFReader {
+public:
+	CAFFReader(const unsigned char* data, size_t size) : reader(data, size) {}
+
+	//Read the header block, it has to be the first block of the file
+	CAFFError readHeader(CAFFHeader& header);
+	//Read the next credits or animation block
+	//The tags of an animation block are split into tags if it is given, see parseCIFF
+	CAFFError next(CAFFBlock& block, std::vector<std::string_view>* tags = nullptr);
+	//Check that every announced animation block was read
+	CAFFError finish() const;
+
+	//Check if every block has been read
+	bool empty() const { return reader.empty(); }
+	//Number of animation blocks read so far
+	size_t frames() const { return frame; }
+
+private:
+	ByteReader reader;
+	size_t num_anim = 0;
+	size_t frame = 0;
+};
+
+//Walk the block headers of a CAFF file using their length fields, without reading the block data
+//On success index holds the position of every block, it is cleared first so it can be reused
+CAFFError indexCAFFBlocks(const unsigned char* data, size_t size, std::vector<CAFFBlockIndexEntry>& index);
+
+//Growable buffer the encoded images are written to
+//clear() keeps the memory, so a buffer reused for many images only allocates when an image is larger than any before
+class OutputBuffer {
+public:
+	//Forget the contents but keep the memory
+	void clear() { length = 0; }
+	//Append bytes to the end of the buffer
+	void append(const void* data, size_t size);
+
+	const unsigned char* data() const { return bytes.data(); }
+	size_t size() const { return length; }
+
+	//stbi_write_func callback, the context is the OutputBuffer
+	static void write(void* context, void* data, int size);
+
+private:
+	std::vector<unsigned char> bytes;
+	size_t length = 0;
+};
+
+//File formats the images can be written in
+enum class OutputFormat {
+	jpg,
+	png,
+	bmp,
+	tga,
+	//Binary PPM (P6), the pixels are copied without encoding
+	ppm
+};
+
+//Chroma subsampling of the JPEG output
+enum class ChromaSubsampling {
+	//4:2:0 up to quality 90, 4:4:4 above it
+	automatic,
+	yuv420,
+	yuv444
+};
+
+//How the images are encoded
+struct EncodeOptions {
+	OutputFormat format = OutputFormat::jpg;
+	//JPEG quality, 1..100
+	int quality = 50;
+	ChromaSubsampling subsampling = ChromaSubsampling::automatic;
+	//Make JPEG Huffman tables for every image instead of using the standard ones
+	//The files get smaller but the quantised image is kept in memory between the two encoding passes
+	bool optimizeHuffman = false;
+	//Use the fixed-point colour conversion and DCT of the JPEG encoder
+	//The output is the same byte for byte on every build and CPU, at a slightly lower PSNR than the float path
+	bool integerDCT = false;
+	//Number of threads one JPEG image is encoded on, see JPEGEncoder::encodeParallel
+	unsigned threads = 1;
+};
+
+//File name extension of a format, without the dot
+const char* outputExtension(OutputFormat format);
+
+//JPEG encoder of one quality level
+//The quantisation tables and the file header are made once in the constructor and only read afterwards,
+//so one encoder can be used for any number of images from any number of threads
+class JPEGEncoder {
+public:
+	explicit JPEGEncoder(int quality, ChromaSubsampling subsampling = ChromaSubsampling::automatic, bool optimizeHuffman = false, bool integerDCT = false);
+
+	//Encode the pixels of a CIFF image, the output is cleared first
+	CAFFError encode(const CIFFImage& image, OutputBuffer& output) const;
+	//Encode the image as horizontal bands separated by restart markers, up to threadCount bands at once
+	//Images too small to be worth splitting, and encoders with optimised Huffman tables, encode like encode()
+	CAFFError encodeParallel(const CIFFImage& image, OutputBuffer& output, unsigned threadCount) const;
+	//Height of the bands encodeParallel splits an image into, 0 if it encodes it in one piece like encode()
+	//The restart markers between the bands change the bytes, so the output depends on this and not on the thread count itself
+	size_t bandHeight(size_t width, size_t height, unsigned threadCount) const;
+
+	//Tables and header for the stbi_write_jpg_*_ctx functions
+	const stbi_write_jpg_context* context() const { return &tables; }
+
+private:
+	stbi_write_jpg_context tables;
+};
+
+//Shared encoder of a quality level, made when it is first asked for
+//Qualities are clamped to 1..100, 0 means 90 like in stbi_write_jpg
+const JPEGEncoder& jpegEncoder(int quality, ChromaSubsampling subsampling = ChromaSubsampling::automatic, bool optimizeHuffman = false, bool integerDCT = false);
+
+//Encode the pixels of a CIFF image to JPEG with the shared encoder of the quality, the output is cleared first
+CAFFError encodeJPEG(const CIFFImage& image, int quality, OutputBuffer& output);
+
+//Header of a binary PPM file of the given size
+//The header and the pixels of a CIFF image together are the PPM file
+std::string_view ppmHeader(size_t width, size_t height, char (&buffer)[64]);
+
+//Encode the pixels of a CIFF image in the format of the options, the output is cleared first
+CAFFError encodeImage(const CIFFImage& image, const EncodeOptions& options, OutputBuffer& output);
+
+//Stages of a conversion timed by the stats, see statsEnabled
+enum class StatsStage {
+	//Reading and checking CAFF block headers, the bounds checks and seeks of walking the blocks
+	blockHeader,
+	//Parsing the CAFF header, the credits and the CIFF headers
+	header,
+	//Handing the pixel rows to the JPEG encoder and gathering them into MCUs, the page faults of a mapped file land here
+	pixelRead,
+	//RGB to YCbCr conversion and chroma subsampling of the JPEG encoder
+	colorConversion,
+	//DCT and quantisation of the JPEG encoder
+	dct,
+	//Huffman coding of the JPEG encoder, with optimised tables counting the symbols as well
+	huffman,
+	//Encoding an image in any format, the JPEG stages above included
+	encode,
+	//Writing the output files
+	fileWrite,
+	count
+};
+
+//Counters of the stats
+enum class StatsCounter {
+	//Input files opened
+	files,
+	//Bytes of the input files
+	bytesRead,
+	//CAFF block headers read
+	blocksParsed,
+	//Images encoded in any format, an image found in the result cache is a cache hit instead
+	imagesEncoded,
+	//MCUs encoded by the JPEG encoder
+	mcusEncoded,
+	//Bytes of the output files
+	outputBytes,
+	//Images found in and missing from the result cache
+	cacheHits,
+	cacheMisses,
+	count
+};
+
+//Name of a stage or a counter in snake case, for machine readable output
+const char* statsStageName(StatsStage stage);
+const char* statsCounterName(StatsCounter counter);
+
+//Timers and counters of the conversions on one thread, or their sum over threads
+struct ConversionStats {
+	//Time spent in each stage in nanoseconds, and how many times it was timed
+	uint64_t nanoseconds[size_t(StatsStage::count)] = {};
+	uint64_t calls[size_t(StatsStage::count)] = {};
+	uint64_t counters[size_t(StatsCounter::count)] = {};
+
+	//Add the timers and counters of other to these
+	void add(const ConversionStats& other);
+	//What was added to these stats since they were copied to earlier
+	ConversionStats since(const ConversionStats& earlier) const;
+};
+
+//Turns the stats on, it has to be set before the conversions start and left alone while they run
+//While it is false every instrumented point only tests it, no clock is read and no counter is touched
+extern bool statsEnabled;
+
+//Monotonic clock of the stats in nanoseconds
+uint64_t statsClock();
+//Stats of the calling thread, they are kept in collectStats() after the thread exits
+ConversionStats& threadStats();
+//Sum of the stats of every thread so far, the running threads must not be converting anything
+ConversionStats collectStats();
+
+//Add to a counter of the calling thread
+inline void countStat(StatsCounter counter, uint64_t amount) {
+	if (statsEnabled) {
+		threadStats().counters[size_t(counter)] += amount;
+	}
+}
+
+//Adds the time between its construction and its destruction to a stage of the calling thread
+class StageTimer {
+public:
+	explicit StageTimer(StatsStage stage) : stage(stage), start(statsEnabled ? statsClock() : 0) {}
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+	~StageTimer() {
+		if (start != 0) {
+			ConversionStats& stats = threadStats();
+			stats.nanoseconds[size_t(stage)] += statsClock() - start;
+			stats.calls[size_t(stage)]++;
+		}
+	}
+
+private:
+	StatsStage stage;
+	//0 while the stats are disabled
+	uint64_t start;
+};
+
+//Stage timers of one call of the JPEG encoder, added to the stats of the calling thread when destroyed
+//Pass get() to stbi_write_jpg_stats_to_func_ctx, it is nullptr while the stats are disabled
+class JPEGStageTimers {
+public:
+	JPEGStageTimers() : enabled(statsEnabled) {
+		if (enabled) {
+			start();
+		}
+	}
+	JPEGStageTimers(const JPEGStageTimers&) = delete;
+	JPEGStageTimers& operator=(const JPEGStageTimers&) = delete;
+	~JPEGStageTimers() {
+		if (enabled) {
+			finish();
+		}
+	}
+
+	stbi_write_jpg_stats* get() { return enabled ? &timers : nullptr; }
+
+private:
+	void start();
+	void finish();
+
+	bool enabled;
+	stbi_write_jpg_stats timers;
+};
+
+//Turns the trace on, like statsEnabled it has to be set before the conversions start
+//While it is false every traced call only tests it
+extern bool traceEnabled;
+
+//One traced call, a complete event of the Chrome trace event format
+struct TraceEvent {
+	//A string literal
+	const char* name;
+	//statsClock() at the start and the end of the call
+	uint64_t start;
+	uint64_t end;
+	//Animation frame index, -1 if not known
+	int64_t frame;
+	uint64_t bytes;
+	//Number of the thread that made the call, from 1 in the order the threads were first traced
+	uint32_t thread;
+};
+
+//Store an event in the ring buffer of the calling thread
+//Only the thread itself writes its ring, so recording takes no lock, the oldest events are overwritten when it is full
+void recordTraceEvent(const TraceEvent& event);
+//Copy the events of every thread so far into events, it is cleared first
+//The threads must not be tracing anything, returns the number of events that were overwritten
+size_t collectTrace(std::vector<TraceEvent>& events);
+
+//Traces a call from its construction to its destruction
+class TraceScope {
+public:
+	explicit TraceScope(const char* name, int64_t frame = -1, uint64_t bytes = 0) : name(name), frame(frame), bytes(bytes), start(traceEnabled ? statsClock() : 0) {}
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+	~TraceScope() {
+		if (start != 0) {
+			recordTraceEvent({ name, start, statsClock(), frame, bytes, 0 });
+		}
+	}
+
+	//Set the byte count when it is only known at the end of the call
+	void setBytes(uint64_t value) { bytes = value; }
+
+private:
+	const char* name;
+	int64_t frame;
+	uint64_t bytes;
+	//0 while the trace is disabled
+	uint64_t start;
+};
@@ -1,510 +1,1981 @@
-#define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
 #include <optional>
 #include <vector>
+#include <set>
 #include <filesystem>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 #include "stb_image_write.h"
+#include "caff.h"
 
-struct CAFFBlockType {
-public:
-	static const uint8_t header = '\x01';
-	static const uint8_t credits = '\x02';
-	static const uint8_t animation = '\x03';
+//Range of animation frames to convert, negative values count back from the last frame
+struct FrameRange {
+	long long first;
+	long long last;
+	//Stands for the frame in the middle of the animation, first and last are ignored
+	bool middle;
 };
 
-struct CAFFBlockHeader {
-	uint8_t id;
-	size_t length;
+//Read-only memory mapping of a whole file
+//The parser works directly on the mapped bytes, so nothing is copied out of the page cache
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	//Map the file into memory, returns false if it could not be opened or mapped
+	//Sequential access reads ahead aggressively, otherwise only the pages that are touched are read
+	bool open(const std::string& filePath, bool sequential = true);
+	//Unmap the file
+	void close();
+
+	//Hint that the bytes in the range are going to be read soon
+	void prefetch(const unsigned char* begin, size_t size) const;
+	//Drop the resident pages that lie completely inside the range, they are read from the file again if needed
+	void release(const unsigned char* begin, size_t size) const;
+
+	const unsigned char* data() const { return mapped; }
+	size_t size() const { return length; }
+
+private:
+	const unsigned char* mapped = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE mapping = nullptr;
+#endif
 };
 
-//Method to check if the file still has enough bytes to read
-bool canReadBytes(std::ifstream& file, std::streampos currentPos, std::streamsize numBytes) {
-	file.seekg(currentPos + numBytes);
-	if (file && file.tellg() != -1) {
-		file.seekg(currentPos);
+#ifdef _WIN32
+bool MappedFile::open(const std::string& filePath, bool) {
+	close();
+	HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		return false;
+	}
+	//An empty file can't be mapped, but it is still a (too short) input for the parser
+	if (fileSize.QuadPart == 0) {
+		CloseHandle(file);
 		return true;
 	}
-	file.seekg(currentPos);
-	return false;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return false;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr) {
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+	mapped = static_cast<const unsigned char*>(view);
+	length = size_t(fileSize.QuadPart);
+	return true;
 }
 
-//Gets the file stream 
-std::optional<CAFFBlockHeader> readCAFFBlockHeader(std::ifstream& file) {
-	//Check if the filestream is still good
-	if (!file.good()) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return std::nullopt;
+void MappedFile::close() {
+	if (mapped != nullptr) {
+		UnmapViewOfFile(mapped);
 	}
-	//Check if there are 9 bytes to read in the file
-	if (!canReadBytes(file, file.tellg(), 9)) {
-		std::cerr << "Not enough bytes left in the file!" << std::endl;
-		return std::nullopt;
+	if (mapping != nullptr) {
+		CloseHandle(mapping);
 	}
-	//Block ID byte
-	unsigned char id = 0;
-	//Block length integer
-	size_t length = 0;
+	mapped = nullptr;
+	mapping = nullptr;
+	length = 0;
+}
 
-	//Read the ID and length fields
-	if (!file.read(reinterpret_cast<char*>(&id), sizeof(id))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return std::nullopt;
+//The page cache is left to Windows
+void MappedFile::prefetch(const unsigned char*, size_t) const {
+}
+
+void MappedFile::release(const unsigned char*, size_t) const {
+}
+#else
+bool MappedFile::open(const std::string& filePath, bool sequential) {
+	close();
+	int fd = ::open(filePath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
 	}
-	if (!file.read(reinterpret_cast<char*>(&length), sizeof(length))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return std::nullopt;
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+	//An empty file can't be mapped, but it is still a (too short) input for the parser
+	if (info.st_size == 0) {
+		::close(fd);
+		return true;
+	}
+	void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (view == MAP_FAILED) {
+		return false;
+	}
+	//The blocks are parsed front to back
+	madvise(view, size_t(info.st_size), sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+	mapped = static_cast<const unsigned char*>(view);
+	length = size_t(info.st_size);
+	return true;
+}
+
+void MappedFile::close() {
+	if (mapped != nullptr) {
+		munmap(const_cast<unsigned char*>(mapped), length);
+	}
+	mapped = nullptr;
+	length = 0;
+}
+
+void MappedFile::prefetch(const unsigned char* begin, size_t size) const {
+	//Clamp the range to the mapping and round it out to whole pages
+	const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+	uintptr_t first = std::max(uintptr_t(begin), uintptr_t(mapped));
+	uintptr_t last = std::min(uintptr_t(begin) + size, uintptr_t(mapped) + length);
+	if (first >= last) {
+		return;
+	}
+	first &= ~(pageSize - 1);
+	madvise(reinterpret_cast<void*>(first), last - first, MADV_WILLNEED);
+}
+
+void MappedFile::release(const unsigned char* begin, size_t size) const {
+	//Clamp the range to the mapping and shrink it to the whole pages inside
+	const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+	uintptr_t first = std::max(uintptr_t(begin), uintptr_t(mapped));
+	uintptr_t last = std::min(uintptr_t(begin) + size, uintptr_t(mapped) + length);
+	first = (first + pageSize - 1) & ~(pageSize - 1);
+	last &= ~(pageSize - 1);
+	if (first >= last) {
+		return;
+	}
+	//The mapping is read-only and backed by the file, so dropping the pages loses nothing
+	madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+}
+#endif
+
+//Name of a temporary file next to path that no other thread or process uses, to be renamed over path once written
+std::string temporaryPath(const std::string& path) {
+	std::ostringstream name;
+#ifdef _WIN32
+	name << path << ".tmp" << GetCurrentProcessId() << "_" << std::this_thread::get_id();
+#else
+	name << path << ".tmp" << getpid() << "_" << std::this_thread::get_id();
+#endif
+	return name.str();
+}
+
+//Hands the pixel rows of a frame to the JPEG encoder one MCU band at a time
+//The bands that are already encoded are released from the mapping and the next one is prefetched,
+//so only a few MCU rows of a frame are resident however tall it is
+struct PixelBands {
+	const MappedFile* file;
+	const unsigned char* pixels;
+	size_t stride;
+	//Animation frame index for the trace
+	int64_t frame;
+
+	//stbi_write_jpg_rows_func callback
+	static const void* rows(void* context, int first_row, int num_rows) {
+		const PixelBands* bands = static_cast<const PixelBands*>(context);
+		const unsigned char* band = bands->pixels + size_t(first_row) * bands->stride;
+		size_t bandSize = size_t(num_rows) * bands->stride;
+		TraceScope trace("pixelRead", bands->frame, bandSize);
+		if (bands->file != nullptr) {
+			bands->file->release(bands->pixels, size_t(band - bands->pixels));
+			bands->file->prefetch(band + bandSize, bandSize);
+		}
+		return band;
 	}
+};
+
+//64 bit hash of a stream of bytes, the XXH64 algorithm
+//The input is read as little-endian words, so a hash is the same on every machine
+//The bytes can be added in pieces of any size, the hash is that of all of them in one piece
+class XXH64 {
+public:
+	explicit XXH64(uint64_t seed) : lanes{ seed + prime1 + prime2, seed + prime2, seed, seed - prime1 }, seed(seed) {}
 
-	//Make the block header struct
-	CAFFBlockHeader header = { id, length };
+	void update(const unsigned char* data, size_t size);
+	uint64_t digest() const;
 
-	//Check if it's a header block and the length is correctly 20 bytes (magic(4) + header_size(8) + num_anim(8))
-	if (header.id == CAFFBlockType::header && header.length == 20) {
-		return header;
+private:
+	static const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+	static const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+	static const uint64_t prime3 = 0x165667B19E3779F9ull;
+	static const uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+	static const uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+	static uint64_t rotate(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+	static uint64_t round(uint64_t accumulator, uint64_t input) { return rotate(accumulator + input * prime2, 31) * prime1; }
+	//Four independent lanes of 8 bytes over a 32 byte stripe
+	void stripe(const unsigned char* data) {
+		for (int i = 0; i < 4; i++) {
+			lanes[i] = round(lanes[i], loadLittleEndian<uint64_t>(data + 8 * i));
+		}
 	}
-	//Check if it's a credits block and the length is at least 14 bytes (date(6) + creator_len(8))
-	if (header.id == CAFFBlockType::credits && header.length >= 14) {
-		return header;
+
+	uint64_t lanes[4];
+	uint64_t seed;
+	uint64_t total = 0;
+	//Bytes of an unfinished stripe
+	unsigned char buffer[32];
+	size_t buffered = 0;
+};
+
+void XXH64::update(const unsigned char* data, size_t size) {
+	total += size;
+	if (buffered > 0) {
+		size_t count = std::min(size, sizeof(buffer) - buffered);
+		memcpy(buffer + buffered, data, count);
+		buffered += count;
+		data += count;
+		size -= count;
+		if (buffered < sizeof(buffer)) {
+			return;
+		}
+		stripe(buffer);
+		buffered = 0;
 	}
-	//Check if it's an animation block and the length is at least 42 bytes (duration(8) + CIFF headers (36))
-	if (header.id == CAFFBlockType::animation && header.length >= 42) {
-		return header;
+	for (; size >= 32; data += 32, size -= 32) {
+		stripe(data);
 	}
-	//If ID is not those types return nullopt
-	std::cerr << "Id or length of CAFF block is not correct! " << std::endl << "Header Id: " << header.id << std::endl << "Header length: " << header.length << std::endl;
-	return std::nullopt;
+	memcpy(buffer, data, size);
+	buffered = size;
 }
 
-//Read and check the CAFF Header block data
-bool readCAFFHeaderBlock(std::ifstream& file) {
-	//Check if the filestream is still good
-	if (!file.good()) {
-		std::cerr << "Failed to read file!" << std::endl;
+uint64_t XXH64::digest() const {
+	uint64_t hash;
+	if (total >= 32) {
+		hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+		for (uint64_t lane : lanes) {
+			hash = (hash ^ round(0, lane)) * prime1 + prime4;
+		}
+	}
+	else {
+		hash = seed + prime5;
+	}
+	hash += total;
+	const unsigned char* data = buffer;
+	const unsigned char* end = buffer + buffered;
+	for (; end - data >= 8; data += 8) {
+		hash = rotate(hash ^ round(0, loadLittleEndian<uint64_t>(data)), 27) * prime1 + prime4;
+	}
+	if (end - data >= 4) {
+		hash = rotate(hash ^ (uint64_t(loadLittleEndian<uint32_t>(data)) * prime1), 23) * prime2 + prime3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		hash = rotate(hash ^ (*data * prime5), 11) * prime1;
+	}
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	hash *= prime3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+//On-disk cache of encoded images, shared by any number of threads and processes
+//An entry is a file named after the 64 bit hash of the pixels and the encoder settings, so identical uploads are encoded once
+//Entries are written to a temporary file and renamed into place, so a reader never sees half of one
+//A hit touches the modification time of the entry, and when the directory grows past its size limit
+//the entries used longest ago are removed until it is back under 90% of the limit
+//Every process counts only its own stores since it last looked, so processes storing at the same time
+//can take the directory past the limit until the next of them trims it
+class ResultCache {
+public:
+	//Key of an encoded image
+	typedef uint64_t Key;
+
+	//Use the directory as the cache, it is made if missing and trimmed to maxBytes
+	//Returns with false if the directory can't be made
+	bool open(const std::string& path, uint64_t maxBytes);
+
+	//Key of the image of width * height RGB pixels encoded with the options
+	//The caption and tags of a CIFF are not part of it, they don't change the image
+	//When the pixels point into source they are hashed in one pass band by band, and the bands are released
+	//from the mapping behind the hash like behind the encoder
+	static Key key(const MappedFile* source, const unsigned char* pixels, size_t width, size_t height, const EncodeOptions& options);
+	//Copy the entry of the key into output, returns false if there is none
+	bool load(const Key& key, const EncodeOptions& options, OutputBuffer& output) const;
+	//Add an encoded image to the cache, failing to store it only costs a later encoding
+	void store(const Key& key, const EncodeOptions& options, const OutputBuffer& image);
+
+private:
+	std::string entryPath(const Key& key, const EncodeOptions& options) const;
+	//Remove the entries used longest ago until the directory is under 90% of the limit
+	void evict();
+
+	std::filesystem::path directory;
+	uint64_t limit = 0;
+	//Size of the directory as last counted plus what this process has stored since, other processes add to it too
+	std::atomic<uint64_t> estimate{ 0 };
+	std::mutex evicting;
+};
+
+bool ResultCache::open(const std::string& path, uint64_t maxBytes) {
+	std::error_code error;
+	directory = path;
+	limit = maxBytes;
+	std::filesystem::create_directories(directory, error);
+	if (!std::filesystem::is_directory(directory, error)) {
 		return false;
 	}
-	//Check if we have enough space in the file to read
-	if (!canReadBytes(file, file.tellg(), 20)) {
-		std::cerr << "Not enough bytes left in the file!" << std::endl;
+	evict();
+	return true;
+}
+
+ResultCache::Key ResultCache::key(const MappedFile* source, const unsigned char* pixels, size_t width, size_t height, const EncodeOptions& options) {
+	//Everything that changes the encoded bytes: the thread count only does through the restart bands of a parallel encoding,
+	//so their height is part of the key and not the thread count
+	int quality = options.quality == 0 ? 90 : std::clamp(options.quality, 1, 100);
+	size_t bandHeight = options.format != OutputFormat::jpg ? 0 :
+		jpegEncoder(options.quality, options.subsampling, options.optimizeHuffman, options.integerDCT).bandHeight(width, height, options.threads);
+	unsigned char settings[37] = { 'C', 'A', 'F', 'F', 'C', 'A', 'C', '3', (unsigned char)options.format, (unsigned char)quality,
+		(unsigned char)options.subsampling, (unsigned char)options.optimizeHuffman, (unsigned char)options.integerDCT };
+	for (size_t i = 0; i < 8; i++) {
+		settings[13 + i] = (unsigned char)(uint64_t(width) >> (8 * i));
+		settings[21 + i] = (unsigned char)(uint64_t(height) >> (8 * i));
+		settings[29 + i] = (unsigned char)(uint64_t(bandHeight) >> (8 * i));
+	}
+	XXH64 hash(0);
+	hash.update(settings, sizeof(settings));
+	//The same bands as the encoder reads, 16 rows at a time
+	PixelBands bands = { source, pixels, width * 3, -1 };
+	for (size_t row = 0; row < height; row += 16) {
+		int rows = int(std::min<size_t>(16, height - row));
+		hash.update(static_cast<const unsigned char*>(PixelBands::rows(&bands, int(row), rows)), size_t(rows) * bands.stride);
+	}
+	if (source != nullptr) {
+		source->release(pixels, width * height * 3);
+	}
+	return hash.digest();
+}
+
+std::string ResultCache::entryPath(const Key& key, const EncodeOptions& options) const {
+	std::ostringstream name;
+	name << std::hex << std::setfill('0') << std::setw(16) << key << "." << outputExtension(options.format);
+	return (directory / name.str()).string();
+}
+
+bool ResultCache::load(const Key& key, const EncodeOptions& options, OutputBuffer& output) const {
+	std::string path = entryPath(key, options);
+	MappedFile entry;
+	//An entry another process is removing is a miss, once it is mapped it stays readable
+	if (!entry.open(path) || entry.size() == 0) {
+		countStat(StatsCounter::cacheMisses, 1);
 		return false;
 	}
-	//Header magic characters
-	char magic[4];
-	//Header size integer
-	size_t header_size = 0;
-	//Number of animation blocks integer
-	size_t num_anim = 0;
+	output.clear();
+	output.append(entry.data(), entry.size());
+	std::error_code error;
+	std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+	countStat(StatsCounter::cacheHits, 1);
+	return true;
+}
+
+void ResultCache::store(const Key& key, const EncodeOptions& options, const OutputBuffer& image) {
+	if (image.size() == 0 || image.size() > limit) {
+		return;
+	}
+	//The temporary name is unique to the process and the thread
+	std::string path = entryPath(key, options);
+	std::string tempPath = temporaryPath(path);
+	std::error_code error;
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(image.data()), std::streamsize(image.size()));
+		if (!out.flush()) {
+			out.close();
+			std::filesystem::remove(tempPath, error);
+			return;
+		}
+	}
+	//Two processes storing the same key write the same bytes, whichever rename comes last wins
+	std::filesystem::rename(tempPath, path, error);
+	if (error) {
+		std::filesystem::remove(tempPath, error);
+		return;
+	}
+	uint64_t size = estimate += image.size();
+	if (size > limit) {
+		evict();
+	}
+}
+
+void ResultCache::evict() {
+	//Temporary files this old were left by a process that died while writing them
+	const auto abandoned = std::chrono::hours(1);
+	std::lock_guard<std::mutex> lock(evicting);
+	struct Entry {
+		std::filesystem::path path;
+		std::filesystem::file_time_type used;
+		uint64_t size;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+	std::error_code error;
+	auto now = std::filesystem::file_time_type::clock::now();
+	for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(directory, error)) {
+		std::error_code fileError;
+		std::filesystem::file_time_type used = file.last_write_time(fileError);
+		uint64_t size = file.file_size(fileError);
+		//Removed by another process meanwhile
+		if (fileError || !file.is_regular_file(fileError)) {
+			continue;
+		}
+		if (file.path().filename().string().find(".tmp") != std::string::npos) {
+			if (now - used > abandoned) {
+				std::filesystem::remove(file.path(), fileError);
+			}
+			continue;
+		}
+		entries.push_back({ file.path(), used, size });
+		total += size;
+	}
+	if (total > limit) {
+		std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+		for (const Entry& entry : entries) {
+			if (total <= limit / 10 * 9) {
+				break;
+			}
+			std::filesystem::remove(entry.path, error);
+			total -= entry.size;
+		}
+	}
+	estimate = total;
+}
+
+//Encodes validated CIFF pixel data to image files, JPEG by default
+//With more than one thread the frames are queued to a pool of workers and encoded concurrently,
+//otherwise they are encoded right away on the calling thread
+//When the pixels point into source, they are streamed from it band by band
+//With a cache the images found in it are copied from there instead of being encoded, and the others are added to it
+class FrameEncoder {
+public:
+	FrameEncoder(unsigned threadCount, const MappedFile* source, const EncodeOptions& options, ResultCache* cache = nullptr);
+	FrameEncoder(const FrameEncoder&) = delete;
+	FrameEncoder& operator=(const FrameEncoder&) = delete;
+	//Drops the frames that are still queued and stops the workers
+	~FrameEncoder();
+
+	//Encode the pixels to name.jpg (or the extension of the format), the pixels have to stay valid until finish() returns
+	//Blocks while the queue is full, so the parser never runs far ahead of the workers
+	//frame is the animation frame index in the trace
+	void encode(std::string name, size_t frame, const unsigned char* pixels, size_t width, size_t height);
+	//Wait until every queued frame is encoded, returns false if any of them failed
+	bool finish();
+
+private:
+	struct Job {
+		std::string name;
+		size_t frame;
+		const unsigned char* pixels;
+		size_t width;
+		size_t height;
+	};
+
+	//Write one image file, the image is encoded into the buffer first and written with a single call
+	//Returns false if it was not successful
+	bool writeImage(const Job& job, OutputBuffer& buffer) const;
+	//Worker thread loop
+	void work();
+
+	//Mapping the pixels are read from, nullptr if they are not from a mapped file
+	const MappedFile* source;
+	EncodeOptions options;
+	//Shared by the workers, the tables are made once for every frame
+	const JPEGEncoder& jpeg;
+	ResultCache* cache;
+	std::vector<std::thread> workers;
+	//Output buffer of the frames encoded on the calling thread, every worker has its own
+	OutputBuffer buffer;
+	std::deque<Job> jobs;
+	//Maximum number of queued jobs
+	size_t capacity = 0;
+	//Number of jobs the workers are encoding right now
+	size_t active = 0;
+	bool stopping = false;
+	//Names of the frames that could not be encoded
+	std::vector<std::string> failed;
+	std::mutex mutex;
+	std::condition_variable jobQueued;
+	std::condition_variable jobFinished;
+};
+
+FrameEncoder::FrameEncoder(unsigned threadCount, const MappedFile* source, const EncodeOptions& options, ResultCache* cache) :
+	source(source), options(options), jpeg(jpegEncoder(options.quality, options.subsampling, options.optimizeHuffman, options.integerDCT)), cache(cache) {
+	//A single thread encodes inline, there is nothing to overlap it with
+	if (threadCount > 1) {
+		capacity = size_t(threadCount) * 2;
+		for (unsigned i = 0; i < threadCount; i++) {
+			workers.emplace_back(&FrameEncoder::work, this);
+		}
+	}
+}
+
+FrameEncoder::~FrameEncoder() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.clear();
+		stopping = true;
+	}
+	jobQueued.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+bool FrameEncoder::writeImage(const Job& job, OutputBuffer& buffer) const {
+	std::string name = job.name + "." + outputExtension(options.format);
+	size_t content_size = job.width * job.height * 3;
+
+	//The pixels are already in PPM order, so they go to the file straight from the file data
+	if (options.format == OutputFormat::ppm) {
+		countStat(StatsCounter::imagesEncoded, 1);
+		StageTimer timer(StatsStage::fileWrite);
+		TraceScope trace("writeFile", int64_t(job.frame), job.width * job.height * 3);
+		char text[64];
+		std::string_view header = ppmHeader(job.width, job.height, text);
+		countStat(StatsCounter::outputBytes, header.size() + content_size);
+		std::ofstream file(name, std::ios::binary | std::ios::trunc);
+		file.write(header.data(), std::streamsize(header.size()));
+		file.write(reinterpret_cast<const char*>(job.pixels), std::streamsize(content_size));
+		return bool(file.flush());
+	}
+
+	//An image in the cache is not encoded again, it is counted in the cache hits instead of the encoded images
+	ResultCache::Key key = 0;
+	bool cached = false;
+	if (cache != nullptr) {
+		TraceScope trace("cacheLookup", int64_t(job.frame), content_size);
+		key = ResultCache::key(source, job.pixels, job.width, job.height, options);
+		cached = cache->load(key, options, buffer);
+	}
+
+	//Encode the image into memory, the JPEG encoder streams the pixels band by band,
+	//or with more than one thread encodes the bands at the same time straight from the pixels
+	if (!cached) {
+		countStat(StatsCounter::imagesEncoded, 1);
+		StageTimer timer(StatsStage::encode);
+		TraceScope trace("encode", int64_t(job.frame));
+		CIFFImage image = { job.width, job.height, {}, {}, job.pixels, content_size };
+		if (options.format == OutputFormat::jpg && options.threads > 1) {
+			if (jpeg.encodeParallel(image, buffer, options.threads) != CAFFError::none) {
+				return false;
+			}
+		}
+		else if (options.format == OutputFormat::jpg) {
+			PixelBands bands = { source, job.pixels, job.width * 3, int64_t(job.frame) };
+			TraceScope jpegTrace("stbi_write_jpg", int64_t(job.frame));
+			JPEGStageTimers timers;
+			buffer.clear();
+			if (stbi_write_jpg_stats_to_func_ctx(&OutputBuffer::write, &buffer, (int)job.width, (int)job.height, 3, nullptr, &PixelBands::rows, &bands, 0, 0, jpeg.context(), timers.get()) == 0) {
+				return false;
+			}
+			jpegTrace.setBytes(buffer.size());
+		}
+		else {
+			if (encodeImage(image, options, buffer) != CAFFError::none) {
+				return false;
+			}
+		}
+		trace.setBytes(buffer.size());
+	}
+	if (!cached && cache != nullptr) {
+		TraceScope trace("cacheStore", int64_t(job.frame), buffer.size());
+		cache->store(key, options, buffer);
+	}
+
+	//Make the file, the timer runs until it is closed
+	StageTimer timer(StatsStage::fileWrite);
+	TraceScope trace("writeFile", int64_t(job.frame), buffer.size());
+	countStat(StatsCounter::outputBytes, buffer.size());
+	std::ofstream file(name, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(buffer.data()), std::streamsize(buffer.size()));
+	return bool(file.flush());
+}
+
+void FrameEncoder::work() {
+	//Reused for every frame of this worker
+	OutputBuffer buffer;
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			jobQueued.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty()) {
+				return;
+			}
+			job = std::move(jobs.front());
+			jobs.pop_front();
+			active++;
+		}
+		//Let the parser queue the next frame while this one is encoded
+		jobFinished.notify_all();
+
+		bool result = writeImage(job, buffer);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			active--;
+			if (!result) {
+				failed.push_back(job.name);
+			}
+		}
+		jobFinished.notify_all();
+	}
+}
 
-	//Read the header fields
-	if (!file.read(magic, sizeof(magic))) {
-		std::cerr << "Failed to read file!" << std::endl;
+void FrameEncoder::encode(std::string name, size_t frame, const unsigned char* pixels, size_t width, size_t height) {
+	Job job = { std::move(name), frame, pixels, width, height };
+	if (workers.empty()) {
+		if (!writeImage(job, buffer)) {
+			failed.push_back(job.name);
+		}
+		return;
+	}
+	{
+		//Time the parser spends waiting for the workers shows in the trace
+		TraceScope trace("queueWait", int64_t(frame));
+		std::unique_lock<std::mutex> lock(mutex);
+		jobFinished.wait(lock, [this] { return jobs.size() < capacity; });
+		jobs.push_back(std::move(job));
+	}
+	jobQueued.notify_one();
+}
+
+bool FrameEncoder::finish() {
+	std::unique_lock<std::mutex> lock(mutex);
+	jobFinished.wait(lock, [this] { return jobs.empty() && active == 0; });
+	for (const std::string& name : failed) {
+		std::cerr << "Failed to make " << outputExtension(options.format) << " file!" << std::endl << "File: " << name << "." << outputExtension(options.format) << std::endl;
+	}
+	bool result = failed.empty();
+	failed.clear();
+	return result;
+}
+
+//Print the data of a CAFF credits block
+void printCredits(const CAFFCredits& credits) {
+	//If there is no creator only the date is printed
+	if (!credits.creator.empty()) {
+		std::cout << "CAFF Creator: " << credits.creator << '\n';
+	}
+	std::cout << "Creation date: " << credits.year << "." << static_cast<int>(credits.month) << "." << static_cast<int>(credits.day) << ". " << static_cast<int>(credits.hour) << ":" << static_cast<int>(credits.minute) << '\n';
+}
+
+//Print the metadata of a CIFF image, with the tags parseCIFF split
+//The lines are not flushed one by one, std::cerr flushes std::cout before any error message
+void printCIFF(const CIFFImage& image, const std::vector<std::string_view>& tags) {
+	std::cout << "CIFF size: " << image.width << " x " << image.height << '\n';
+	std::cout << "Caption: " << image.caption << '\n';
+	std::cout << "Tags: ";
+	for (std::string_view tag : tags) {
+		std::cout << tag << " ";
+	}
+	std::cout << '\n';
+}
+
+//Read and verify the CIFF file and queue the pixels to the encoder to make the JPEG after
+//Encoding errors are reported by FrameEncoder::finish()
+//Without an encoder the file is only verified, the pixels are skipped without being read and nothing is printed
+//Returns the rule the file breaks, CAFFError::none if successful
+CAFFError readCIFFFile(const unsigned char* data, size_t size, std::string fileName, FrameEncoder* encoder) {
+	CIFFImage image;
+	std::vector<std::string_view> tags;
+	CAFFError error = parseCIFF(data, size, image, encoder != nullptr ? &tags : nullptr);
+	if (error != CAFFError::none) {
+		std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CIFF file!" << std::endl;
+		return error;
+	}
+	//The pixels are handed to the encoder straight from the file data
+	if (encoder != nullptr) {
+		encoder->encode(fileName, 0, image.pixels, image.width, image.height);
+		printCIFF(image, tags);
+	}
+	return CAFFError::none;
+}
+
+//Name of the JPEG file of an animation frame when converting more than the first one
+std::string frameFileName(const std::string& fileName, size_t frame) {
+	std::ostringstream name;
+	name << fileName << "_" << std::setw(4) << std::setfill('0') << frame;
+	return name.str();
+}
+
+//Read the CAFF files
+//By default only the first animation block is converted to fileName.jpg
+//With allFrames every animation block is converted to fileName_0000.jpg, fileName_0001.jpg, ...
+//and the number of blocks has to match the num_anim field of the header
+//The frames are queued to the encoder, call FrameEncoder::finish() to wait for the JPEG files
+//Without an encoder the file is only verified and nothing is printed
+//On success frames holds the number of animation blocks that were read
+//Returns the rule the file breaks, CAFFError::none if successful
+CAFFError readCAFFFile(const unsigned char* data, size_t size, std::string fileName, bool allFrames, FrameEncoder* encoder, size_t& frames) {
+	CAFFReader caff(data, size);
+	CAFFHeader header;
+	CAFFError error = caff.readHeader(header);
+	if (error != CAFFError::none) {
+		std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CAFF Header Block!" << std::endl;
+		return error;
+	}
+
+	//Sum of the frame durations
+	size_t total_duration = 0;
+
+	//Read until we get one animation block (or every block with allFrames) or something goes wrong
+	bool finished = false;
+	std::vector<std::string_view> tags;
+	while (!finished) {
+		//With allFrames the blocks are read until the end of the file
+		if (allFrames && caff.frames() > 0 && caff.empty()) {
+			break;
+		}
+		CAFFBlock block;
+		error = caff.next(block, encoder != nullptr ? &tags : nullptr);
+		if (error != CAFFError::none) {
+			std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CAFF Block!" << std::endl;
+			return error;
+		}
+		if (block.id == CAFFBlockType::credits) {
+			if (encoder != nullptr) {
+				printCredits(block.credits);
+			}
+			continue;
+		}
+		//Name the frames by their index when converting all of them
+		size_t frame = caff.frames() - 1;
+		const CIFFImage& image = block.frame.image;
+		if (encoder != nullptr) {
+			encoder->encode(allFrames ? frameFileName(fileName, frame) : fileName, frame, image.pixels, image.width, image.height);
+			printCIFF(image, tags);
+			if (allFrames) {
+				std::cout << "Frame " << frame << " duration: " << block.frame.duration << " ms" << '\n';
+			}
+		}
+		total_duration += block.frame.duration;
+		finished = !allFrames;
+	}
+
+	//Check if every announced animation block was present
+	if (allFrames) {
+		if (caff.finish() != CAFFError::none) {
+			std::cerr << caffErrorMessage(CAFFError::animationCount) << std::endl << "Number of animations is: " << caff.frames() << " when it should be: " << header.num_anim << std::endl;
+			return CAFFError::animationCount;
+		}
+		if (encoder != nullptr) {
+			std::cout << "Frames: " << caff.frames() << std::endl;
+			std::cout << "Total duration: " << total_duration << " ms" << std::endl;
+		}
+	}
+	frames = caff.frames();
+	return CAFFError::none;
+}
+
+
+//Read the chosen animation frames of a CAFF file through its block index, without parsing the other animation blocks
+//The header and credits blocks are still verified, and the number of animation blocks has to match num_anim
+//The frames are converted to fileName_0000.jpg, ... named by their index and queued to the encoder
+//On success frames holds the number of converted frames
+//Returns with true if successful, otherwise false
+bool readCAFFFrames(const unsigned char* data, const CAFFBlockIndexEntry* index, size_t blocks, std::string fileName, const std::vector<FrameRange>& selection, FrameEncoder* encoder, size_t& frames) {
+	//Check if the first block is a header block
+	if (blocks == 0 || index[0].id != CAFFBlockType::header) {
+		std::cerr << "The first block was not a header block!" << std::endl;
 		return false;
 	}
-	if (!file.read(reinterpret_cast<char*>(&header_size), sizeof(header_size))) {
-		std::cerr << "Failed to read file!" << std::endl;
+	CAFFHeader header;
+	ByteReader headerBlock(data + index[0].offset, size_t(index[0].length));
+	CAFFError error = parseCAFFHeaderBlock(headerBlock, header);
+	if (error != CAFFError::none) {
+		std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CAFF Header Block!" << std::endl;
 		return false;
 	}
-	if (!file.read(reinterpret_cast<char*>(&num_anim), sizeof(num_anim))) {
-		std::cerr << "Failed to read file!" << std::endl;
+
+	//Verify the credits and collect the animation blocks
+	std::vector<const CAFFBlockIndexEntry*> animations;
+	for (size_t i = 1; i < blocks; i++) {
+		const CAFFBlockIndexEntry& entry = index[i];
+		ByteReader block(data + entry.offset, size_t(entry.length));
+		switch (entry.id) {
+		case CAFFBlockType::header:
+			std::cerr << "Multiple Header Blocks in the file!" << std::endl;
+			return false;
+		case CAFFBlockType::credits: {
+			CAFFCredits credits;
+			error = parseCAFFCreditsBlock(block, size_t(entry.length), credits);
+			if (error != CAFFError::none) {
+				std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CAFF Credits Block!" << std::endl;
+				return false;
+			}
+			printCredits(credits);
+			break;
+		}
+		case CAFFBlockType::animation:
+			animations.push_back(&entry);
+			break;
+		}
+	}
+	if (animations.size() != header.num_anim) {
+		std::cerr << caffErrorMessage(CAFFError::animationCount) << std::endl << "Number of animations is: " << animations.size() << " when it should be: " << header.num_anim << std::endl;
+		return false;
+	}
+
+	//Resolve the selection to frame indices
+	std::vector<size_t> chosen;
+	for (const FrameRange& range : selection) {
+		long long count = (long long)(animations.size());
+		long long first = range.middle ? count / 2 : range.first < 0 ? count + range.first : range.first;
+		long long last = range.middle ? count / 2 : range.last < 0 ? count + range.last : range.last;
+		if (first < 0 || last >= count || first > last) {
+			std::cerr << "Frame is out of range!" << std::endl << "Number of animations: " << count << std::endl;
+			return false;
+		}
+		for (long long frame = first; frame <= last; frame++) {
+			chosen.push_back(size_t(frame));
+		}
+	}
+	std::sort(chosen.begin(), chosen.end());
+	chosen.erase(std::unique(chosen.begin(), chosen.end()), chosen.end());
+
+	//Jump straight to the chosen animation blocks
+	std::vector<std::string_view> tags;
+	for (size_t frame : chosen) {
+		const CAFFBlockIndexEntry& entry = *animations[frame];
+		ByteReader block(data + entry.offset, size_t(entry.length));
+		CAFFFrame animation;
+		{
+			TraceScope trace("readCIFF", int64_t(frame), entry.length);
+			error = parseCAFFAnimationBlock(block, size_t(entry.length), animation, &tags);
+		}
+		if (error != CAFFError::none) {
+			std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CAFF Animation Block!" << std::endl;
+			return false;
+		}
+		if (encoder != nullptr) {
+			encoder->encode(frameFileName(fileName, frame), frame, animation.image.pixels, animation.image.width, animation.image.height);
+		}
+		printCIFF(animation.image, tags);
+		std::cout << "Frame " << frame << " duration: " << animation.duration << " ms" << '\n';
+	}
+	frames = chosen.size();
+	return true;
+}
+
+//Header of the sidecar index file, followed by block_count CAFFBlockIndexEntry records
+//The file is mapped and the entries are used in place, so every field has a fixed size and the entries stay 8 byte aligned
+//The source size, modification time and hash tell if the index still belongs to the CAFF file next to it
+struct CAFFIndexFileHeader {
+	char magic[8];
+	//Written as 0x01020304, an index made on a machine with the other byte order is rebuilt
+	uint32_t byte_order;
+	uint32_t entry_size;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+	uint64_t block_count;
+};
+
+static const char caffIndexMagic[8] = { 'C', 'A', 'F', 'F', 'I', 'D', 'X', '1' };
+
+//Path of the sidecar index file of a CAFF file
+std::string indexFilePath(const std::string& filePath) {
+	return filePath + ".idx";
+}
+
+//Quick fingerprint of the source file for the sidecar index: FNV-1a over the first and last 64 KiB
+//Hashing the whole file would cost more than the header walk the index saves
+uint64_t hashIndexSource(const unsigned char* data, size_t size) {
+	const size_t sample = 64 * 1024;
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](const unsigned char* bytes, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	};
+	if (size <= 2 * sample) {
+		mix(data, size);
+	}
+	else {
+		mix(data, sample);
+		mix(data + size - sample, sample);
+	}
+	return hash;
+}
+
+//Fill the source fields of an index file header for the mapped CAFF file
+//Returns with false if the modification time of the file can't be read
+bool describeIndexSource(const std::string& filePath, const MappedFile& source, CAFFIndexFileHeader& header) {
+	std::error_code error;
+	std::filesystem::file_time_type mtime = std::filesystem::last_write_time(filePath, error);
+	if (error) {
 		return false;
 	}
+	memcpy(header.magic, caffIndexMagic, sizeof(header.magic));
+	header.byte_order = 0x01020304;
+	header.entry_size = sizeof(CAFFBlockIndexEntry);
+	header.source_size = source.size();
+	header.source_mtime = int64_t(mtime.time_since_epoch().count());
+	header.source_hash = hashIndexSource(source.data(), source.size());
+	return true;
+}
+
+//Mapped sidecar index file, the block entries are read straight from the mapping
+class CAFFIndexFile {
+public:
+	//Map the index file of the CAFF and check that it belongs to the current source file
+	//Returns with false if there is no index file or it is stale or damaged, then the blocks have to be walked again
+	bool open(const std::string& filePath, const MappedFile& source);
+
+	const CAFFBlockIndexEntry* entries() const { return blocks; }
+	size_t size() const { return count; }
 
-	//Check if the magic characters are "CAFF"
-	if (std::string(magic, sizeof(magic)) != "CAFF") {
-		std::cerr << "Magic is not CAFF" << std::endl << "Magic: " << magic << std::endl;
+private:
+	MappedFile file;
+	const CAFFBlockIndexEntry* blocks = nullptr;
+	size_t count = 0;
+};
+
+bool CAFFIndexFile::open(const std::string& filePath, const MappedFile& source) {
+	CAFFIndexFileHeader expected;
+	if (!describeIndexSource(filePath, source, expected) || !file.open(indexFilePath(filePath), false) || file.size() < sizeof(CAFFIndexFileHeader)) {
 		return false;
 	}
-	//Check if the header size is equal to 20 (magic(4) + header_size(8) + num_anim(8))
-	if (header_size != 20) {
-		std::cerr << "Header size is not correct" << std::endl << "Header size: " << header_size << std::endl;
+	const CAFFIndexFileHeader* header = reinterpret_cast<const CAFFIndexFileHeader*>(file.data());
+	if (memcmp(header->magic, expected.magic, sizeof(header->magic)) != 0 || header->byte_order != expected.byte_order ||
+		header->entry_size != expected.entry_size || header->source_size != expected.source_size ||
+		header->source_mtime != expected.source_mtime || header->source_hash != expected.source_hash ||
+		header->block_count != (file.size() - sizeof(CAFFIndexFileHeader)) / sizeof(CAFFBlockIndexEntry) ||
+		(file.size() - sizeof(CAFFIndexFileHeader)) % sizeof(CAFFBlockIndexEntry) != 0) {
 		return false;
 	}
-	//Check if there are CIFFs to parse
-	if (num_anim < 1) {
-		std::cerr << "No CIFF image to convert!" << std::endl;
-		return false;
+	const CAFFBlockIndexEntry* entries = reinterpret_cast<const CAFFBlockIndexEntry*>(file.data() + sizeof(CAFFIndexFileHeader));
+	//The index is trusted no more than the file, every block has to lie inside the source
+	for (size_t i = 0; i < header->block_count; i++) {
+		if (entries[i].offset > source.size() || entries[i].length > source.size() - entries[i].offset) {
+			return false;
+		}
+	}
+	blocks = entries;
+	count = size_t(header->block_count);
+	return true;
+}
+
+//Write the sidecar index file of a CAFF file
+//The index is written to a temporary file first and renamed over the old one, so a reader never sees half of it
+//Returns with true if successful, otherwise false
+bool writeCAFFIndexFile(const std::string& filePath, const MappedFile& source, const std::vector<CAFFBlockIndexEntry>& index) {
+	CAFFIndexFileHeader header;
+	if (!describeIndexSource(filePath, source, header)) {
+		return false;
+	}
+	header.block_count = index.size();
+
+	//Processes indexing the same file at the same time each write their own temporary file
+	std::string tempPath = temporaryPath(indexFilePath(filePath));
+	std::error_code error;
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(index.data()), std::streamsize(index.size() * sizeof(CAFFBlockIndexEntry)));
+		if (!out.flush()) {
+			out.close();
+			std::filesystem::remove(tempPath, error);
+			return false;
+		}
+	}
+	std::filesystem::rename(tempPath, indexFilePath(filePath), error);
+	if (error) {
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+	return true;
+}
+
+//Input file types
+enum class InputType {
+	caff,
+	ciff
+};
+
+//Options of a conversion
+struct ConvertOptions {
+	//Convert every animation block of a CAFF instead of only the first
+	bool allFrames = false;
+	//Convert only these animation blocks of a CAFF, found through the block index
+	std::vector<FrameRange> frames;
+	//Load the block index from the sidecar file next to the CAFF, and write it there when it is missing or stale
+	bool indexFile = false;
+	//Format, quality and chroma subsampling of the output
+	//encode.threads splits a single image into restart-interval bands, only when --threads is given
+	//as the bands change the file and are encoded from the whole image instead of streamed
+	EncodeOptions encode;
+	//Number of JPEG encoder threads over the frames
+	unsigned threads = 1;
+	//Encoded images of earlier conversions, nullptr to always encode
+	ResultCache* cache = nullptr;
+};
+
+//Map, parse and convert one file, the JPEG files are written to the working directory named after the file
+//On success frames holds the number of converted frames
+//Returns with true if successful, otherwise false
+bool convertFile(const std::string& filePath, const std::string& fileName, InputType type, const ConvertOptions& options, size_t& frames) {
+	//Chosen frames are reached through the block index, so the file is not read front to back
+	bool randomAccess = type == InputType::caff && !options.frames.empty();
+
+	//Try to map the file
+	MappedFile file;
+	if (!file.open(filePath, !randomAccess)) {
+		std::cerr << "Failed to open file!" << std::endl;
+		return false;
+	}
+	countStat(StatsCounter::files, 1);
+	countStat(StatsCounter::bytesRead, file.size());
+	//Several frames are encoded in parallel, a single image can be split into bands that are encoded in parallel instead
+	bool singleImage = type == InputType::ciff || (!randomAccess && !options.allFrames);
+	EncodeOptions encode = options.encode;
+	encode.threads = singleImage ? options.encode.threads : 1;
+	//The encoder is declared after the file so its workers are stopped before the file is unmapped
+	FrameEncoder encoder(singleImage ? 1 : options.threads, &file, encode, options.cache);
+	if (randomAccess) {
+		//Use the sidecar index if it is up to date, otherwise walk the blocks
+		CAFFIndexFile indexFile;
+		std::vector<CAFFBlockIndexEntry> index;
+		bool indexLoaded = options.indexFile && indexFile.open(filePath, file);
+		if (!indexLoaded) {
+			CAFFError error = indexCAFFBlocks(file.data(), file.size(), index);
+			if (error != CAFFError::none) {
+				std::cerr << caffErrorMessage(error) << std::endl << "Failed to parse CAFF Block!" << std::endl;
+				return false;
+			}
+			//Not being able to save the index doesn't stop the conversion
+			if (options.indexFile && !writeCAFFIndexFile(filePath, file, index)) {
+				std::cerr << "Failed to write index file!" << std::endl;
+			}
+		}
+		const CAFFBlockIndexEntry* entries = indexLoaded ? indexFile.entries() : index.data();
+		size_t blocks = indexLoaded ? indexFile.size() : index.size();
+		//Convert the chosen frames
+		if (!readCAFFFrames(file.data(), entries, blocks, fileName, options.frames, &encoder, frames)) {
+			return false;
+		}
+	}
+	else if (type == InputType::caff) {
+		//Read the CAFF file and make the JPEG
+		if (readCAFFFile(file.data(), file.size(), fileName, options.allFrames, &encoder, frames) != CAFFError::none) {
+			return false;
+		}
+	}
+	else {
+		//Read the CIFF file and make the JPEG
+		if (readCIFFFile(file.data(), file.size(), fileName, &encoder) != CAFFError::none) {
+			return false;
+		}
+		frames = 1;
+	}
+	return encoder.finish();
+}
+
+//Map and verify one file against every rule of the parser without encoding it
+//Every animation block of a CAFF is checked, the pixel data is skipped without being read
+//On success frames holds the number of frames in the file, otherwise error the rule the file breaks
+//(CAFFError::none if it could not be opened)
+//Returns with true if the file is valid, otherwise false
+bool validateFile(const std::string& filePath, InputType type, size_t& frames, CAFFError& error) {
+	error = CAFFError::none;
+	//Only the headers are touched, so there is no point in reading ahead
+	MappedFile file;
+	if (!file.open(filePath, false)) {
+		std::cerr << "Failed to open file!" << std::endl;
+		return false;
+	}
+	countStat(StatsCounter::files, 1);
+	countStat(StatsCounter::bytesRead, file.size());
+	if (type == InputType::caff) {
+		error = readCAFFFile(file.data(), file.size(), "", true, nullptr, frames);
+		return error == CAFFError::none;
+	}
+	error = readCIFFFile(file.data(), file.size(), "", nullptr);
+	if (error != CAFFError::none) {
+		return false;
+	}
+	frames = 1;
+	return true;
+}
+
+//Escape a string for a JSON string literal
+std::string jsonString(std::string_view text) {
+	std::ostringstream escaped;
+	escaped << '"';
+	for (char ch : text) {
+		if (ch == '"' || ch == '\\') {
+			escaped << '\\' << ch;
+		}
+		else if (static_cast<unsigned char>(ch) < 0x20) {
+			escaped << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(ch) << std::dec;
+		}
+		else {
+			escaped << ch;
+		}
+	}
+	escaped << '"';
+	return escaped.str();
+}
+
+//Format the timers and counters of a conversion as a JSON object
+//Every stage is an object with its total time in milliseconds and the number of times it was timed
+std::string statsJSON(const ConversionStats& stats) {
+	std::ostringstream json;
+	json << "{\"stages\":{";
+	for (size_t i = 0; i < size_t(StatsStage::count); i++) {
+		json << (i > 0 ? "," : "") << "\"" << statsStageName(StatsStage(i)) << "\":{\"ms\":" << double(stats.nanoseconds[i]) / 1e6 << ",\"calls\":" << stats.calls[i] << "}";
+	}
+	json << "},\"counters\":{";
+	for (size_t i = 0; i < size_t(StatsCounter::count); i++) {
+		json << (i > 0 ? "," : "") << "\"" << statsCounterName(StatsCounter(i)) << "\":" << stats.counters[i];
+	}
+	json << "}}";
+	return json.str();
+}
+
+//Write the events of every thread as a Chrome trace event JSON file, for chrome://tracing or Perfetto
+//The times are in microseconds from the first event, the events that were overwritten are counted in the metadata
+//Returns with true if successful, otherwise false
+bool writeTraceFile(const std::string& path) {
+	std::vector<TraceEvent> events;
+	size_t overwritten = collectTrace(events);
+	uint64_t origin = UINT64_MAX;
+	for (const TraceEvent& event : events) {
+		origin = std::min(origin, event.start);
+	}
+	std::ofstream file(path, std::ios::trunc);
+	file << std::fixed << std::setprecision(3);
+	file << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"overwritten_events\":" << overwritten << "},\"traceEvents\":[";
+	for (size_t i = 0; i < events.size(); i++) {
+		const TraceEvent& event = events[i];
+		file << (i > 0 ? ",\n" : "\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+			<< ",\"ts\":" << double(event.start - origin) / 1000 << ",\"dur\":" << double(event.end - event.start) / 1000 << ",\"args\":{";
+		if (event.frame >= 0) {
+			file << "\"frame\":" << event.frame << ",";
+		}
+		file << "\"bytes\":" << event.bytes << "}}";
+	}
+	file << "\n]}\n";
+	return bool(file.flush());
+}
+
+//Match a file name against a glob pattern with '*' and '?' wildcards
+bool matchGlob(std::string_view pattern, std::string_view name) {
+	size_t p = 0;
+	size_t n = 0;
+	//Position of the last '*' in the pattern and the name position it was tried at
+	size_t star = std::string_view::npos;
+	size_t starMatch = 0;
+	while (n < name.length()) {
+		if (p < pattern.length() && (pattern[p] == '?' || pattern[p] == name[n])) {
+			p++;
+			n++;
+		}
+		else if (p < pattern.length() && pattern[p] == '*') {
+			star = p++;
+			starMatch = n;
+		}
+		else if (star != std::string_view::npos) {
+			//Let the last '*' swallow one more character
+			p = star + 1;
+			n = ++starMatch;
+		}
+		else {
+			return false;
+		}
+	}
+	while (p < pattern.length() && pattern[p] == '*') {
+		p++;
+	}
+	return p == pattern.length();
+}
+
+//Collect the files of a batch
+//The source is a directory (every .caff and .ciff file in it), a glob pattern for the file names in a directory,
+//or '-' to read a newline separated list of paths from the standard input
+std::optional<std::vector<std::string>> collectBatchFiles(const std::string& source) {
+	std::vector<std::string> files;
+	if (source == "-") {
+		std::string line;
+		while (std::getline(std::cin, line)) {
+			//Accept CRLF lists as well
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (!line.empty()) {
+				files.push_back(line);
+			}
+		}
+		return files;
+	}
+
+	std::error_code error;
+	std::filesystem::path path(source);
+	std::filesystem::path directory = path;
+	std::string pattern = "*";
+	bool filterExtension = true;
+	if (source.find_first_of("*?") != std::string::npos) {
+		directory = path.parent_path().empty() ? std::filesystem::path(".") : path.parent_path();
+		pattern = path.filename().string();
+		filterExtension = false;
+	}
+	if (!std::filesystem::is_directory(directory, error)) {
+		std::cerr << "Incorrect batch source!" << std::endl;
+		return std::nullopt;
+	}
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory, error)) {
+		if (!entry.is_regular_file(error)) {
+			continue;
+		}
+		std::string name = entry.path().filename().string();
+		std::string extension = entry.path().extension().string();
+		if (filterExtension && extension != ".caff" && extension != ".ciff") {
+			continue;
+		}
+		if (matchGlob(pattern, name)) {
+			files.push_back(entry.path().string());
+		}
+	}
+	if (error) {
+		std::cerr << "Failed to list batch source!" << std::endl << error.message() << std::endl;
+		return std::nullopt;
 	}
-	return true;
+	//Directory order is unspecified, keep the runs reproducible
+	std::sort(files.begin(), files.end());
+	return files;
 }
 
-//Read and check the CAFF Creadits block data
-bool readCAFFCreditsBlock(std::ifstream& file, size_t credits_length) {
-	//Check if the filestream is still good
-	if (!file.good()) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
-	}
-	//Check if the file has enough data to read for the credits
-	if (!canReadBytes(file, file.tellg(), credits_length)) {
-		std::cerr << "Not enough bytes left in the file!" << std::endl;
-		return false;
+//Output names of the files of a batch, the stems of the files like in single file mode
+//Files with the same stem (in different directories, or a .caff and a .ciff) would write the same output files
+//from different workers, so a stem that is taken already gets _1, _2, ... added in the order of the files
+std::vector<std::string> batchOutputNames(const std::vector<std::string>& files) {
+	std::vector<std::string> names;
+	std::set<std::string> taken;
+	for (const std::string& file : files) {
+		std::string stem = std::filesystem::path(file).stem().string();
+		std::string name = stem;
+		for (size_t i = 1; !taken.insert(name).second; i++) {
+			name = stem + "_" + std::to_string(i);
+		}
+		names.push_back(name);
 	}
-	//Creation date 
-	uint16_t year = 0;
-	uint8_t month = 0;
-	uint8_t day = 0;
-	uint8_t hour = 0;
-	uint8_t minute = 0;
-	//Creator length integer
-	size_t creator_length = 0;
+	return names;
+}
 
-	//Read date and creator length
-	if (!file.read(reinterpret_cast<char*>(&year), sizeof(year))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+//Stream buffer that drops everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+	int overflow(int ch) override {
+		return ch;
 	}
-	if (!file.read(reinterpret_cast<char*>(&month), sizeof(month))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+};
+
+//Stream buffer that appends what a thread writes to the string of that thread, without one it is dropped
+//The batch workers share std::cerr, this keeps the messages of every file apart
+class ThreadCapture : public std::streambuf {
+public:
+	//Where the writes of the calling thread go, nullptr to drop them
+	static thread_local std::string* target;
+
+protected:
+	int overflow(int ch) override {
+		if (target != nullptr && ch != traits_type::eof()) {
+			target->push_back(char(ch));
+		}
+		return ch;
 	}
-	if (!file.read(reinterpret_cast<char*>(&day), sizeof(day))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	std::streamsize xsputn(const char* text, std::streamsize count) override {
+		if (target != nullptr) {
+			target->append(text, size_t(count));
+		}
+		return count;
 	}
-	if (!file.read(reinterpret_cast<char*>(&hour), sizeof(hour))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+};
+
+thread_local std::string* ThreadCapture::target = nullptr;
+
+//Format the lines of the messages as a JSON array of strings
+std::string jsonLines(std::string_view messages) {
+	std::string json = "[";
+	while (!messages.empty()) {
+		size_t end = messages.find('\n');
+		std::string_view line = messages.substr(0, end);
+		if (!line.empty()) {
+			json += (json.length() > 1 ? "," : "") + jsonString(line);
+		}
+		messages.remove_prefix(end == std::string_view::npos ? messages.length() : end + 1);
 	}
-	if (!file.read(reinterpret_cast<char*>(&minute), sizeof(minute))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	return json + "]";
+}
+
+//Convert (or with validateOnly just verify) every file of a batch in this process
+//The files are taken from a shared queue by the worker threads, each file is encoded on the thread that parsed it
+//One JSON object is printed per file as it finishes, then one with the totals
+//The error messages of a file that failed are in its object, and a converted file names its output files
+//An invalid file names the rule it breaks in "rule", the name of its CAFFError
+//With the stats enabled every object gets the timers and counters of its file, the totals their sum over the batch
+//Returns with true if every file was converted or valid
+bool runBatch(const std::vector<std::string>& files, const ConvertOptions& options, bool validateOnly) {
+	//The messages of the parser would interleave between the workers, only the summary is printed
+	//and the error messages are collected for the object of their file
+	std::ostream summary(std::cout.rdbuf());
+	NullBuffer discard;
+	ThreadCapture capture;
+	std::streambuf* out = std::cout.rdbuf(&discard);
+	std::streambuf* err = std::cerr.rdbuf(&capture);
+	std::vector<std::string> outputNames = batchOutputNames(files);
+
+	//The batch is parallel over the files, each file is encoded by the worker that took it
+	ConvertOptions fileOptions = options;
+	fileOptions.threads = 1;
+	fileOptions.encode.threads = 1;
+
+	std::mutex summaryMutex;
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> converted(0);
+	auto work = [&]() {
+		for (size_t i = next++; i < files.size(); i = next++) {
+			const std::string& filePath = files[i];
+			auto start = std::chrono::steady_clock::now();
+			//A file is converted on this thread only, so its stats are what this thread adds meanwhile
+			ConversionStats statsBefore;
+			if (statsEnabled) {
+				statsBefore = threadStats();
+			}
+
+			//The type comes from the extension, the output is named after the file like in single file mode
+			std::filesystem::path path(filePath);
+			std::string extension = path.extension().string();
+			bool result = false;
+			size_t frames = 0;
+			//Rule a file failed validation on
+			CAFFError rule = CAFFError::none;
+			std::string messages;
+			ThreadCapture::target = &messages;
+			if (extension == ".caff" || extension == ".ciff") {
+				InputType type = extension == ".caff" ? InputType::caff : InputType::ciff;
+				if (validateOnly) {
+					result = validateFile(filePath, type, frames, rule);
+				}
+				else {
+					result = convertFile(filePath, outputNames[i], type, fileOptions, frames);
+				}
+			}
+			else {
+				std::cerr << "Incorrect file path!" << std::endl;
+			}
+			ThreadCapture::target = nullptr;
+
+			double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (result) {
+				converted++;
+			}
+			std::lock_guard<std::mutex> lock(summaryMutex);
+			summary << "{\"file\":" << jsonString(filePath);
+			if (validateOnly) {
+				summary << ",\"valid\":" << (result ? "true" : "false");
+				if (rule != CAFFError::none) {
+					summary << ",\"rule\":\"" << caffErrorName(rule) << "\"";
+				}
+			}
+			else {
+				summary << ",\"status\":\"" << (result ? "ok" : "failed") << "\",\"output\":" << jsonString(outputNames[i]);
+			}
+			if (!messages.empty()) {
+				summary << ",\"errors\":" << jsonLines(messages);
+			}
+			summary << ",\"frames\":" << frames << ",\"ms\":" << milliseconds;
+			if (statsEnabled) {
+				summary << ",\"stats\":" << statsJSON(threadStats().since(statsBefore));
+			}
+			summary << "}" << std::endl;
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < std::min<size_t>(options.threads, files.size()); i++) {
+		workers.emplace_back(work);
 	}
-	if (!file.read(reinterpret_cast<char*>(&creator_length), sizeof(creator_length))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	work();
+	for (std::thread& worker : workers) {
+		worker.join();
 	}
 
-	//Check if the date format is correct
-	if (year > 9999) {
-		std::cerr << "Year is not correct!" << std::endl << "Year: " << year << std::endl;
-		return false;
+	std::cout.rdbuf(out);
+	std::cerr.rdbuf(err);
+	if (validateOnly) {
+		summary << "{\"files\":" << files.size() << ",\"valid\":" << converted << ",\"invalid\":" << files.size() - converted;
 	}
-	if (month < 1 || month > 12) {
-		std::cerr << "Month is not correct!" << std::endl << "Month: " << month << std::endl;
-		return false;
+	else {
+		summary << "{\"files\":" << files.size() << ",\"ok\":" << converted << ",\"failed\":" << files.size() - converted;
 	}
-	if (day < 1 || day > 31) {
-		std::cerr << "Day is not correct!" << std::endl << "Day: " << day << std::endl;
-		return false;
+	if (statsEnabled) {
+		summary << ",\"stats\":" << statsJSON(collectStats());
 	}
-	if (hour > 24) {
-		std::cerr << "Hour is not correct!" << std::endl << "Hour: " << hour << std::endl;
-		return false;
+	summary << "}" << std::endl;
+	return converted == files.size();
+}
+
+//Conversion service over a Unix domain socket, -serve runs it and -client talks to it
+//Every message starts with a fixed header, the integers are little-endian like in the file formats
+//Request, 20 bytes: magic "CAFQ", source (0: the payload is a file path, 1: the file bytes), type (0: CAFF, 1: CIFF),
+//format (OutputFormat), quality, subsampling (ChromaSubsampling), flags (1: optimised Huffman tables, 2: integer DCT),
+//2 reserved bytes and the payload length (8)
+//Response, 24 bytes: magic "CAFR", status (0: converted, 1: failed), 3 reserved bytes, metadata length (8) and image length (8),
+//followed by the metadata, a JSON object about the file or the error message, and the encoded first frame
+//A connection can carry any number of requests one after the other
+static const size_t requestHeaderSize = 20;
+static const size_t responseHeaderSize = 24;
+//Largest payload a request may have, the file bytes are held in memory
+static const uint64_t maxRequestPayload = uint64_t(1) << 30;
+//Payload memory a worker keeps for the next request, the buffer of a larger file is given back once it is answered
+static const size_t keptPayload = size_t(64) << 20;
+//Seconds a connection may wait between requests, and a request may stall while it is read or its response written
+static const int idleTimeout = 60;
+static const int transferTimeout = 10;
+
+//Append an integer of bytes bytes in little-endian order
+void appendLittleEndian(std::string& out, uint64_t value, size_t bytes) {
+	for (size_t i = 0; i < bytes; i++) {
+		out.push_back(char(value >> (8 * i)));
 	}
-	if (minute > 60) {
-		std::cerr << "Minute is not correct!" << std::endl << "Minute: " << minute << std::endl;
-		return false;
+}
+
+//Verify a whole CAFF or CIFF file and encode its first frame, like -validate followed by a default conversion
+//On success metadata holds a JSON object with the frames, the first image and the credits of the file
+//The image is taken from the cache if it is there, and added to it otherwise
+CAFFError convertRequest(const unsigned char* data, size_t size, InputType type, const EncodeOptions& options, ResultCache* cache, OutputBuffer& image, std::string& metadata) {
+	CIFFImage first = {};
+	size_t frames = 1;
+	size_t duration = 0;
+	std::optional<CAFFCredits> credits;
+	//Tags of the first image
+	std::vector<std::string_view> tags;
+	if (type == InputType::ciff) {
+		CAFFError error = parseCIFF(data, size, first, &tags);
+		if (error != CAFFError::none) {
+			return error;
+		}
 	}
-	//Check if the creator matches up with the CAFF block length
-	if (creator_length != credits_length - 14) {
-		std::cerr << "Creator length mismatch!" << std::endl << "Creator length is: " << creator_length << " when it should be: " << credits_length - 14 << std::endl;
-		return false;
+	else {
+		CAFFReader caff(data, size);
+		CAFFHeader header;
+		CAFFError error = caff.readHeader(header);
+		while (error == CAFFError::none && !caff.empty()) {
+			CAFFBlock block;
+			error = caff.next(block, caff.frames() == 0 ? &tags : nullptr);
+			if (error == CAFFError::none && block.id == CAFFBlockType::credits) {
+				credits = block.credits;
+			}
+			else if (error == CAFFError::none) {
+				if (caff.frames() == 1) {
+					first = block.frame.image;
+				}
+				duration += block.frame.duration;
+			}
+		}
+		if (error == CAFFError::none) {
+			error = caff.finish();
+		}
+		if (error != CAFFError::none) {
+			return error;
+		}
+		frames = caff.frames();
 	}
-	//If there is no creator return and parsing can continue
-	if (creator_length != 0) {
-		//Create char array for the creator string
-		char* creator = new char[creator_length];
 
-		//Read in the creator string
-		if (!file.read(creator, std::streamsize(creator_length))) {
-			std::cerr << "Failed to read file!" << std::endl;
-			delete[] creator;
+	std::ostringstream json;
+	json << "{\"frames\":" << frames << ",\"duration\":" << duration << ",\"width\":" << first.width << ",\"height\":" << first.height
+		<< ",\"caption\":" << jsonString(first.caption) << ",\"tags\":[";
+	for (size_t i = 0; i < tags.size(); i++) {
+		json << (i > 0 ? "," : "") << jsonString(tags[i]);
+	}
+	json << "]";
+	if (credits.has_value()) {
+		json << ",\"creator\":" << jsonString(credits->creator) << ",\"date\":\"" << credits->year << "." << int(credits->month) << "." << int(credits->day)
+			<< ". " << int(credits->hour) << ":" << int(credits->minute) << "\"";
+	}
+	json << "}";
+	metadata = json.str();
+	if (cache == nullptr) {
+		return encodeImage(first, options, image);
+	}
+	ResultCache::Key key = ResultCache::key(nullptr, first.pixels, first.width, first.height, options);
+	if (cache->load(key, options, image)) {
+		return CAFFError::none;
+	}
+	CAFFError error = encodeImage(first, options, image);
+	if (error == CAFFError::none) {
+		cache->store(key, options, image);
+	}
+	return error;
+}
+
+#ifndef _WIN32
+//Read exactly size bytes, returns false at the end of the stream or on an error
+bool readFully(int fd, void* buffer, size_t size) {
+	char* bytes = static_cast<char*>(buffer);
+	while (size > 0) {
+		ssize_t count = ::read(fd, bytes, size);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
 			return false;
 		}
-		//Convert to string
-		std::string screator(creator, creator_length);
-		delete[] creator;
+		bytes += count;
+		size -= size_t(count);
+	}
+	return true;
+}
 
-		//Print the creator
-		std::cout << "CAFF Creator: " << screator << std::endl;
+//Write exactly size bytes, returns false if the other side went away
+bool writeFully(int fd, const void* buffer, size_t size) {
+	const char* bytes = static_cast<const char*>(buffer);
+	while (size > 0) {
+		ssize_t count = ::send(fd, bytes, size, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return false;
+		}
+		bytes += count;
+		size -= size_t(count);
 	}
-	//Print creation time
-	std::cout << "Creation date: " << year << "." << static_cast<int>(month) << "." << static_cast<int>(day) << ". " << static_cast<int>(hour) << ":" << static_cast<int>(minute) << std::endl;
 	return true;
 }
 
-//Read and verify the CIFF file and make the JPEG after
-bool readCIFFFile(std::ifstream& file, std::string fileName) {
-	//Check if the filestream is still good
-	if (!file.good()) {
-		std::cerr << "Failed to read file!" << std::endl;
+//Fill a sockaddr_un with the path, returns false if it is too long
+bool socketAddress(const std::string& socketPath, sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.empty() || socketPath.length() >= sizeof(address.sun_path)) {
 		return false;
 	}
-	//Check if the file has enough data to read the CIFF headers
-	if (!canReadBytes(file, file.tellg(), 36)) {
-		std::cerr << "Not enough bytes left in the file!" << std::endl;
-		return false;
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.length());
+	return true;
+}
+
+//Buffers of a server worker, kept from request to request
+struct ServerBuffers {
+	std::vector<unsigned char> payload;
+	OutputBuffer image;
+	std::string metadata;
+	std::string response;
+
+	//Give back a payload buffer grown past keptPayload, so a few huge uploads don't pin memory for the life of the server
+	void trim() {
+		if (payload.capacity() > keptPayload) {
+			std::vector<unsigned char>().swap(payload);
+		}
 	}
-	//CIFF magic characters
-	char magic[4];
-	//CIFF header size
-	size_t header_size = 0;
-	//CIFF content size
-	size_t content_size = 0;
-	//CIFF image width
-	size_t width = 0;
-	//CIFF image height
-	size_t height = 0;
+};
 
-	//Read in the header fields
-	if (!file.read(magic, sizeof(magic))) {
-		std::cerr << "Failed to read file!" << std::endl;
+//Answer the next request of a connection
+//Returns with false if the client closed the connection, sent something malformed or stalled past the transfer timeout
+bool serveRequest(int fd, ResultCache* cache, ServerBuffers& buffers) {
+	unsigned char header[requestHeaderSize];
+	if (!readFully(fd, header, sizeof(header))) {
 		return false;
 	}
-	if (!file.read(reinterpret_cast<char*>(&header_size), sizeof(header_size))) {
-		std::cerr << "Failed to read file!" << std::endl;
+	uint64_t payloadSize = loadLittleEndian<uint64_t>(header + 12);
+	bool inlineFile = header[4] == 1;
+	if (memcmp(header, "CAFQ", 4) != 0 || header[4] > 1 || header[5] > 1 || header[6] > uint8_t(OutputFormat::ppm) ||
+		header[8] > uint8_t(ChromaSubsampling::yuv444) || payloadSize > maxRequestPayload || (!inlineFile && payloadSize > 4096)) {
 		return false;
 	}
-	if (!file.read(reinterpret_cast<char*>(&content_size), sizeof(content_size))) {
-		std::cerr << "Failed to read file!" << std::endl;
+	buffers.payload.resize(size_t(payloadSize));
+	if (!readFully(fd, buffers.payload.data(), buffers.payload.size())) {
 		return false;
 	}
-	if (!file.read(reinterpret_cast<char*>(&width), sizeof(width))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	EncodeOptions options;
+	options.format = OutputFormat(header[6]);
+	options.quality = header[7];
+	options.subsampling = ChromaSubsampling(header[8]);
+	options.optimizeHuffman = (header[9] & 1) != 0;
+	options.integerDCT = (header[9] & 2) != 0;
+	InputType type = header[5] == 0 ? InputType::caff : InputType::ciff;
+
+	//A path is mapped like in the other modes, the file bytes are parsed where they were received
+	MappedFile file;
+	bool opened = inlineFile || file.open(std::string(buffers.payload.begin(), buffers.payload.end()));
+	bool converted = false;
+	if (opened) {
+		const unsigned char* data = inlineFile ? buffers.payload.data() : file.data();
+		size_t size = inlineFile ? buffers.payload.size() : file.size();
+		CAFFError error = convertRequest(data, size, type, options, cache, buffers.image, buffers.metadata);
+		converted = error == CAFFError::none;
+		if (!converted) {
+			buffers.metadata = caffErrorMessage(error);
+		}
 	}
-	if (!file.read(reinterpret_cast<char*>(&height), sizeof(height))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	else {
+		buffers.metadata = "Failed to open file!";
 	}
-
-	//Check if magic characters are CIFF
-	if (std::string(magic, sizeof(magic)) != "CIFF") {
-		std::cerr << "Magic is not CIFF" << std::endl << "Magic: " << magic << std::endl;
-		return false;
+	if (!converted) {
+		buffers.image.clear();
 	}
 
-	//Check if the header size is at least 36 characters
-	if (header_size <= 36) {
-		std::cerr << "Header size is incorrect" << std::endl << "Header size: " << header_size << std::endl;
-		return false;
-	}
+	buffers.response.assign("CAFR");
+	buffers.response.push_back(converted ? 0 : 1);
+	buffers.response.append(3, '\0');
+	appendLittleEndian(buffers.response, buffers.metadata.size(), 8);
+	appendLittleEndian(buffers.response, buffers.image.size(), 8);
+	buffers.response += buffers.metadata;
+	return writeFully(fd, buffers.response.data(), buffers.response.size()) && writeFully(fd, buffers.image.data(), buffers.image.size());
+}
+
+//Path of the listening socket, removed when the server is stopped
+static char serverSocketPath[sizeof(sockaddr_un::sun_path)];
+
+//SIGINT, SIGTERM, SIGHUP and SIGQUIT handler of the server, unlink and _exit are async-signal-safe
+extern "C" void stopServer(int) {
+	unlink(serverSocketPath);
+	_exit(0);
+}
 
-	//Check if the Content size is width * height * 3
-	if (content_size != width * height * 3) {
-		std::cerr << "Content size is incorrect!" << "Content size: " << content_size << " != " << width << " * " << height << " * " << "3" << std::endl;
+//Check if a server is answering on the socket path, a socket file nobody listens on was left by a server that was killed
+bool serverRunning(const sockaddr_un& address) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
 		return false;
 	}
+	bool running = connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+	close(fd);
+	return running;
+}
 
-	//Check if there are pixels to convert
-	if (content_size == 0) {
-		std::cerr << "No pixels to make JPEG!" << std::endl;
+//Listen on the socket and answer requests with threadCount workers until stopped by a signal
+//The encoder tables of the default options are made up front, the tables of the other options are made by their first request
+//Every worker keeps its buffers, so after warming up a request allocates nothing but its payload (or a payload over keptPayload)
+//The socket is only accessible to the user running the server, the requests can name any file that user can read
+//With a cache the images of files that were converted before are not encoded again
+//A worker only holds a connection for one request, between requests the connection waits in the poll set of the
+//accepting thread, so idle clients don't take workers away from the others
+//Connections idle for longer than idleTimeout are closed, and so are those that stall a request for transferTimeout
+//Returns with false if the socket can't be made, or once polling or accepting connections fails
+bool runServer(const std::string& socketPath, unsigned threadCount, ResultCache* cache) {
+	sockaddr_un address;
+	if (!socketAddress(socketPath, address)) {
+		std::cerr << "Invalid socket path!" << std::endl;
 		return false;
 	}
-
-	//Calculate the remaining size of the header
-	size_t remaining_header_size = header_size - 36;
-
-	//Check if the caption and tags have at least the ending characters
-	if (remaining_header_size < 2) {
-		std::cerr << "Header size is incorrect!" << std::endl;
+	if (serverRunning(address)) {
+		std::cerr << "A server is already running on the socket!" << std::endl;
 		return false;
 	}
-	//Check if the file has enough data to read the CIFF headers
-	if (!canReadBytes(file, file.tellg(), remaining_header_size)) {
-		std::cerr << "Not enough bytes left in file!" << std::endl;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		std::cerr << "Failed to make socket!" << std::endl;
 		return false;
 	}
-	//Read the string until we get a '\n' or run out of header space
-	char ch;
-	size_t counter = 0;
-	std::string caption;
-	bool reading = true;
-	while (reading && file.get(ch)) {
-		if (counter >= remaining_header_size) {
-			std::cerr << "No closing '\\n' in caption!" << std::endl;
-			return false;
-		}
-		if (ch == '\n') {
-			reading = false;
-		}
-		caption += ch;
-		counter++;
+	//Written by the workers when they give a connection back
+	int wakePipe[2];
+	if (pipe(wakePipe) != 0) {
+		std::cerr << "Failed to make socket!" << std::endl;
+		close(listener);
+		return false;
 	}
-	//Subtract the length of the caption from the remaining header size
-	remaining_header_size -= caption.length();
-
-	//The rest of the space is for the tags
-	char* tags = new char[remaining_header_size];
-
-	//Read in the remaining tags
-	if (!file.read(tags, std::streamsize(remaining_header_size))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		delete[] tags;
+	//A socket left behind by a server that was killed is replaced
+	unlink(socketPath.c_str());
+	mode_t mask = umask(0077);
+	bool bound = bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+	umask(mask);
+	if (!bound || listen(listener, 64) != 0) {
+		std::cerr << "Failed to listen on socket!" << std::endl;
+		close(listener);
 		return false;
 	}
+	memcpy(serverSocketPath, address.sun_path, sizeof(serverSocketPath));
+	for (int stopSignal : { SIGINT, SIGTERM, SIGHUP, SIGQUIT }) {
+		signal(stopSignal, stopServer);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	jpegEncoder(EncodeOptions().quality);
 
-	//Check if tags have '\n' in them
-	for (size_t i = 0; i < remaining_header_size; i++) {
-		if (tags[i] == '\n') {
-			std::cerr << "Tags contain '\\n' character!" << std::endl;
-			return false;
+	//Connections with a request waiting go to the workers, and come back through returned when it is answered
+	std::deque<int> connections;
+	std::vector<int> returned;
+	std::mutex mutex;
+	std::condition_variable connectionQueued;
+	bool stopping = false;
+	auto work = [&]() {
+		ServerBuffers buffers;
+		while (true) {
+			int fd;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				connectionQueued.wait(lock, [&connections, &stopping] { return stopping || !connections.empty(); });
+				if (stopping) {
+					return;
+				}
+				fd = connections.front();
+				connections.pop_front();
+			}
+			bool served = serveRequest(fd, cache, buffers);
+			buffers.trim();
+			if (!served) {
+				close(fd);
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				returned.push_back(fd);
+			}
+			//Wake the poll of the accepting thread
+			char wake = 0;
+			while (write(wakePipe[1], &wake, 1) < 0 && errno == EINTR) {
+			}
 		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threadCount; i++) {
+		workers.emplace_back(work);
 	}
-	std::vector<std::string> vtags;
+	std::cout << "Listening on " << socketPath << std::endl;
 
-	//Go through the tags array and divide them by '\0'
-	std::string currentTag;
-	for (size_t i = 0; i < remaining_header_size; i++) {
-		if (tags[i] != '\0') {
-			currentTag += tags[i];
+	//The listener, the wake pipe and the idle connections, with the time each connection went idle
+	std::vector<pollfd> polled = { { listener, POLLIN, 0 }, { wakePipe[0], POLLIN, 0 } };
+	std::vector<std::chrono::steady_clock::time_point> idleSince(2);
+	auto addIdle = [&](int fd) {
+		polled.push_back({ fd, POLLIN, 0 });
+		idleSince.push_back(std::chrono::steady_clock::now());
+	};
+	const timeval transfer = { transferTimeout, 0 };
+	while (true) {
+		if (poll(polled.data(), polled.size(), 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "Failed to poll connections!" << std::endl;
+			break;
 		}
-		else {
-			currentTag += tags[i];
-			vtags.push_back(currentTag);
-			currentTag.clear();
+		//Hand the connections with a request (or a hang up) to the workers, close the ones idle for too long
+		auto now = std::chrono::steady_clock::now();
+		std::vector<int> ready;
+		for (size_t i = 2; i < polled.size();) {
+			bool expired = now - idleSince[i] > std::chrono::seconds(idleTimeout);
+			if (polled[i].revents != 0 || expired) {
+				if (polled[i].revents != 0) {
+					ready.push_back(polled[i].fd);
+				}
+				else {
+					close(polled[i].fd);
+				}
+				polled[i] = polled.back();
+				polled.pop_back();
+				idleSince[i] = idleSince.back();
+				idleSince.pop_back();
+				continue;
+			}
+			i++;
+		}
+		if (!ready.empty()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				connections.insert(connections.end(), ready.begin(), ready.end());
+			}
+			connectionQueued.notify_all();
+		}
+		if (polled[1].revents != 0) {
+			char wake[64];
+			while (read(wakePipe[0], wake, sizeof(wake)) < 0 && errno == EINTR) {
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int fd : returned) {
+				addIdle(fd);
+			}
+			returned.clear();
+		}
+		if (polled[0].revents != 0) {
+			int fd = accept(listener, nullptr, nullptr);
+			if (fd < 0 && errno != EINTR && errno != ECONNABORTED) {
+				std::cerr << "Failed to accept connection!" << std::endl;
+				break;
+			}
+			if (fd >= 0) {
+				//A client that stops sending or reading in the middle of a request gives its worker back after the timeout
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &transfer, sizeof(transfer));
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &transfer, sizeof(transfer));
+				addIdle(fd);
+			}
 		}
 	}
-	delete[] tags;
-
-	//Make the JPEG file from the content of the CIFF
-	//Check if the file has enough space for the files
-	if (!canReadBytes(file, file.tellg(), content_size)) {
-		std::cerr << "Not enough bytes left in file!" << std::endl;
-		return false;
-	}
-
-	//Make the buffer for the JPEG content
-	char* buffer = new char[content_size];
-	if (!file.read(buffer, content_size)) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
-	}
-
-	//Make the file name
-	std::string name = fileName + ".jpg";
-
-	//Make the file.
-	int result = stbi_write_jpg(name.c_str(), (int)width, (int)height, 3, buffer, 50);
-
-	//If the result is 0 it was not successful
-	if (result == 0) {
-		std::cerr << "Failed to make JPEG file!" << std::endl;
-		return false;
+	//Let the workers finish the requests they are answering, then close every connection and remove the socket
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
 	}
-	//Print CIFF data
-	std::cout << "CIFF size: " << width << " x " << height << std::endl;
-	std::cout << "Caption: " << caption << std::endl;
-	std::cout << "Tags: ";
-	for (size_t i = 0; i < vtags.size(); i++) {
-		std::cout << vtags[i] << " ";
+	connectionQueued.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
 	}
-	std::cout << std::endl;
-	return true;
-}
-
-//Read in and verify the CAFF animation block.
-//If successfully verified call the CIFF parser and make the JPEG file
-bool readCAFFAnimationBlock(std::ifstream& file, std::string fileName, size_t animation_length) {
-	//Check if the filestream is still good
-	if (!file.good()) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	for (int stopSignal : { SIGINT, SIGTERM, SIGHUP, SIGQUIT }) {
+		signal(stopSignal, SIG_DFL);
 	}
-	//Check if the file has enough data to read the block
-	if (!canReadBytes(file, file.tellg(), animation_length)) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	for (int fd : connections) {
+		close(fd);
 	}
-
-	//Animation duration
-	size_t duration = 0;
-
-	//Read in the duration
-	if (!file.read(reinterpret_cast<char*>(&duration), sizeof(duration))) {
-		std::cerr << "Failed to read file!" << std::endl;
-		return false;
+	for (int fd : returned) {
+		close(fd);
 	}
-
-	//Read and verify the CIFF file and make the JPEG
-	if (!readCIFFFile(file, fileName)) {
-		std::cerr << "Failed to parse CIFF file!" << std::endl;
-		return false;
+	for (size_t i = 2; i < polled.size(); i++) {
+		close(polled[i].fd);
 	}
-
-	return true;
+	close(wakePipe[0]);
+	close(wakePipe[1]);
+	close(listener);
+	unlink(socketPath.c_str());
+	return false;
 }
 
-//Read the CAFF files
-//Returns with true if successful, otherwise false
-bool readCAFFFile(std::ifstream& file, std::string fileName) {
-	//Start reading CAFF file
-
-	//Read the first block header
-	std::optional<CAFFBlockHeader> firstBlockOpt = readCAFFBlockHeader(file);
-
-	//If something went wrong return with false
-	if (!firstBlockOpt.has_value()) {
-		std::cerr << "Failed to parse CAFF Block!" << std::endl;
+//Send the file to the server repeat times over one connection, write the first response's image next to the working directory
+//and print its metadata, with more than one request print the latencies as well
+//With inlineFile the file bytes are sent, otherwise its absolute path
+//Returns with true if every request was converted
+bool runClient(const std::string& socketPath, const std::string& filePath, const EncodeOptions& options, bool inlineFile, size_t repeat) {
+	std::filesystem::path path(filePath);
+	std::string extension = path.extension().string();
+	if (extension != ".caff" && extension != ".ciff") {
+		std::cerr << "Incorrect file path!" << std::endl;
 		return false;
 	}
-
-	//Get the value of the first block
-	CAFFBlockHeader firstBlock = firstBlockOpt.value();
-
-	//Check if the first block is a header block
-	if (firstBlock.id != CAFFBlockType::header) {
-		std::cerr << "The first block was not a header block!" << std::endl;
-		return false;
+	std::string payload;
+	if (inlineFile) {
+		std::ifstream file(filePath, std::ios::binary);
+		if (!file) {
+			std::cerr << "Failed to open file!" << std::endl;
+			return false;
+		}
+		payload.assign(std::istreambuf_iterator<char>(file), {});
+	}
+	else {
+		std::error_code error;
+		payload = std::filesystem::absolute(path, error).string();
 	}
 
-	if (!readCAFFHeaderBlock(file)) {
-		std::cerr << "Failed to parse CAFF Header Block!" << std::endl;
+	sockaddr_un address;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (!socketAddress(socketPath, address) || fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+		std::cerr << "Failed to connect to server!" << std::endl;
+		if (fd >= 0) {
+			close(fd);
+		}
 		return false;
 	}
 
-	//Read until we get one animation block or something goes wrong
-	bool finished = false;
-	while (!finished) {
-
-		//Read the current CAFF block header
-		std::optional<CAFFBlockHeader> currentBlockOpt = readCAFFBlockHeader(file);
+	std::string request("CAFQ");
+	request.push_back(inlineFile ? 1 : 0);
+	request.push_back(extension == ".caff" ? 0 : 1);
+	request.push_back(char(options.format));
+	request.push_back(char(options.quality));
+	request.push_back(char(options.subsampling));
+	request.push_back(char((options.optimizeHuffman ? 1 : 0) | (options.integerDCT ? 2 : 0)));
+	request.append(2, '\0');
+	appendLittleEndian(request, payload.size(), 8);
+	request += payload;
 
-		//If something went wrong return with false
-		if (!currentBlockOpt.has_value()) {
-			std::cerr << "Failed to parse CAFF Block!" << std::endl;
+	std::vector<double> latencies;
+	std::string metadata;
+	std::vector<char> image;
+	bool converted = true;
+	for (size_t i = 0; i < repeat; i++) {
+		auto start = std::chrono::steady_clock::now();
+		unsigned char header[responseHeaderSize];
+		if (!writeFully(fd, request.data(), request.size()) || !readFully(fd, header, sizeof(header)) || memcmp(header, "CAFR", 4) != 0) {
+			std::cerr << "Failed to talk to server!" << std::endl;
+			close(fd);
 			return false;
 		}
-		//Get the value of the current block and based on its type call the correct function
-		CAFFBlockHeader currentBlock = currentBlockOpt.value();
-
-		switch (currentBlock.id) {
-		//If the block is a header block read it and verify it
-		//If successfully verified continue reading else return with false
-		case CAFFBlockType::header:
-			std::cerr << "Multiple Header Blocks in the file!" << std::endl;
+		metadata.resize(size_t(loadLittleEndian<uint64_t>(header + 8)));
+		image.resize(size_t(loadLittleEndian<uint64_t>(header + 16)));
+		if (!readFully(fd, metadata.data(), metadata.size()) || !readFully(fd, image.data(), image.size())) {
+			std::cerr << "Failed to talk to server!" << std::endl;
+			close(fd);
 			return false;
-			break;
-		//If the block is a credits block read it and verify it
-		//If successfully verified continue reading else return with false
-		case CAFFBlockType::credits:
-			if (!readCAFFCreditsBlock(file, currentBlock.length)) {
-				std::cerr << "Failed to parse CAFF Credits Block!" << std::endl;
-				return false;
-			}
-			break;
-		//If the block is an animation block read it, verify it and make the JPEG file
-		//If successfully verified and the file is made return with true else return with false
-		case CAFFBlockType::animation:
-			if (!readCAFFAnimationBlock(file, fileName, currentBlock.length)) {
-				std::cerr << "Failed to parse CAFF Animation Block!" << std::endl;
-				return false;
+		}
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		converted = converted && header[4] == 0;
+		if (i == 0 && header[4] != 0) {
+			std::cerr << metadata << std::endl << "Failed to convert file!" << std::endl;
+		}
+		else if (i == 0) {
+			std::cout << metadata << std::endl;
+			std::string name = path.stem().string() + "." + outputExtension(options.format);
+			std::ofstream out(name, std::ios::binary | std::ios::trunc);
+			out.write(image.data(), std::streamsize(image.size()));
+			if (!out.flush()) {
+				std::cerr << "Failed to make " << outputExtension(options.format) << " file!" << std::endl << "File: " << name << std::endl;
+				converted = false;
 			}
-			finished = true;
-			break;
 		}
+	}
+	close(fd);
 
+	if (repeat > 1) {
+		std::sort(latencies.begin(), latencies.end());
+		std::cout << "{\"requests\":" << repeat << ",\"p50_ms\":" << latencies[latencies.size() / 2] << ",\"p99_ms\":" << latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)]
+			<< ",\"max_ms\":" << latencies.back() << "}" << std::endl;
 	}
-	return true;
+	return converted;
+}
+#else
+//Unix domain sockets are not used on Windows
+bool runServer(const std::string&, unsigned, ResultCache*) {
+	std::cerr << "The server is not supported on this platform!" << std::endl;
+	return false;
 }
 
-
+bool runClient(const std::string&, const std::string&, const EncodeOptions&, bool, size_t) {
+	std::cerr << "The client is not supported on this platform!" << std::endl;
+	return false;
+}
+#endif
 
 int main(int argc, char* argv[])
 {
-	//Check to see if it was called with two arguments
-	if (argc != 3) {
+	//Check to see if it was called with at least two arguments
+	if (argc < 3) {
 		std::cerr << "Invalid number of arguments!" << std::endl;
 		return -1;
 	}
@@ -514,6 +1985,208 @@ int main(int argc, char* argv[])
 	std::string filePath = argv[2];
 	std::string fileName;
 
+	//Process the optional arguments after the file path
+	ConvertOptions options;
+	//Chrome trace output file of --trace
+	std::string tracePath;
+	//-client sends the file bytes instead of the path with --inline, and the request repeat times with --repeat
+	bool inlineFile = false;
+	size_t repeat = 1;
+	//Number of JPEG encoder threads, defaults to one per core
+	//A single image is encoded in one piece and streamed from the file unless the number is given
+	options.threads = std::max(1u, std::thread::hardware_concurrency());
+	//Result cache of --cache, trimmed to --cache-size MiB
+	std::string cachePath;
+	uint64_t cacheSize = 1024;
+	ResultCache cache;
+	//-client takes the socket and then the file to convert
+	int firstOption = command == "-client" ? 4 : 3;
+	if (argc < firstOption) {
+		std::cerr << "Invalid number of arguments!" << std::endl;
+		return -1;
+	}
+	for (int i = firstOption; i < argc; i++) {
+		std::string option = argv[i];
+		if (option == "--all-frames" && command != "-ciff") {
+			options.allFrames = true;
+		}
+		else if (option == "--threads" && i + 1 < argc) {
+			std::string value = argv[++i];
+			if (value.empty() || value.length() > 4 || value.find_first_not_of("0123456789") != std::string::npos || std::stoul(value) == 0) {
+				std::cerr << "Invalid number of threads: " << value << std::endl;
+				return -1;
+			}
+			options.threads = unsigned(std::stoul(value));
+			options.encode.threads = options.threads;
+		}
+		else if (option == "--frame" && i + 1 < argc && command != "-ciff") {
+			//A frame index, negative from the end, or first, middle or last
+			std::string value = argv[++i];
+			std::string digits = value[0] == '-' ? value.substr(1) : value;
+			if (value == "first" || value == "last" || value == "middle") {
+				long long frame = value == "first" ? 0 : -1;
+				options.frames.push_back({ frame, frame, value == "middle" });
+			}
+			else if (!digits.empty() && digits.length() <= 18 && digits.find_first_not_of("0123456789") == std::string::npos) {
+				long long frame = std::stoll(value);
+				options.frames.push_back({ frame, frame, false });
+			}
+			else {
+				std::cerr << "Invalid frame: " << value << std::endl;
+				return -1;
+			}
+		}
+		else if (option == "--quality" && i + 1 < argc) {
+			std::string value = argv[++i];
+			if (value.empty() || value.length() > 3 || value.find_first_not_of("0123456789") != std::string::npos || std::stoi(value) < 1 || std::stoi(value) > 100) {
+				std::cerr << "Invalid quality: " << value << std::endl;
+				return -1;
+			}
+			options.encode.quality = std::stoi(value);
+		}
+		else if (option == "--subsampling" && i + 1 < argc) {
+			//Chroma subsampling of the JPEG output: 420 or 444
+			std::string value = argv[++i];
+			if (value == "420") {
+				options.encode.subsampling = ChromaSubsampling::yuv420;
+			}
+			else if (value == "444") {
+				options.encode.subsampling = ChromaSubsampling::yuv444;
+			}
+			else {
+				std::cerr << "Invalid chroma subsampling: " << value << std::endl;
+				return -1;
+			}
+		}
+		else if (option == "--optimize-huffman") {
+			//Smaller JPEG files with Huffman tables made for each image
+			options.encode.optimizeHuffman = true;
+		}
+		else if (option == "--integer-dct") {
+			//Fixed-point JPEG encoding, the same bytes on every machine
+			options.encode.integerDCT = true;
+		}
+		else if (option == "--format" && i + 1 < argc) {
+			//Output format: jpg, png, bmp, tga or ppm
+			std::string value = argv[++i];
+			const OutputFormat formats[] = { OutputFormat::jpg, OutputFormat::png, OutputFormat::bmp, OutputFormat::tga, OutputFormat::ppm };
+			const OutputFormat* format = std::find_if(std::begin(formats), std::end(formats), [&value](OutputFormat format) { return value == outputExtension(format); });
+			if (format == std::end(formats)) {
+				std::cerr << "Invalid output format: " << value << std::endl;
+				return -1;
+			}
+			options.encode.format = *format;
+		}
+		else if (option == "--stats") {
+			//Time the stages of the conversion and print them as JSON at the end
+			statsEnabled = true;
+		}
+		else if (option == "--trace" && i + 1 < argc) {
+			//Record the parser and encoder calls of every thread and write them as a Chrome trace at the end
+			tracePath = argv[++i];
+			traceEnabled = true;
+		}
+		else if (option == "--cache" && i + 1 < argc) {
+			//Keep the encoded images in the directory and reuse them for identical images
+			cachePath = argv[++i];
+		}
+		else if (option == "--cache-size" && i + 1 < argc) {
+			std::string value = argv[++i];
+			if (value.empty() || value.length() > 9 || value.find_first_not_of("0123456789") != std::string::npos || std::stoull(value) == 0) {
+				std::cerr << "Invalid cache size: " << value << std::endl;
+				return -1;
+			}
+			cacheSize = std::stoull(value);
+		}
+		else if (option == "--inline" && command == "-client") {
+			inlineFile = true;
+		}
+		else if (option == "--repeat" && i + 1 < argc && command == "-client") {
+			std::string value = argv[++i];
+			if (value.empty() || value.length() > 7 || value.find_first_not_of("0123456789") != std::string::npos || std::stoul(value) == 0) {
+				std::cerr << "Invalid number of requests: " << value << std::endl;
+				return -1;
+			}
+			repeat = std::stoul(value);
+		}
+		else if (option == "--index" && command != "-ciff") {
+			options.indexFile = true;
+		}
+		else if (option == "--frames" && i + 1 < argc && command != "-ciff") {
+			//An inclusive range of frame indices: first-last
+			std::string value = argv[++i];
+			size_t dash = value.find('-');
+			std::string first = value.substr(0, dash);
+			std::string last = dash == std::string::npos ? "" : value.substr(dash + 1);
+			if (first.empty() || last.empty() || first.length() > 18 || last.length() > 18 ||
+				(first + last).find_first_not_of("0123456789") != std::string::npos || std::stoll(first) > std::stoll(last)) {
+				std::cerr << "Invalid frame range: " << value << std::endl;
+				return -1;
+			}
+			options.frames.push_back({ std::stoll(first), std::stoll(last), false });
+		}
+		else {
+			std::cerr << "Invalid option: " << option << std::endl;
+			return -1;
+		}
+	}
+
+	if (!cachePath.empty()) {
+		if (!cache.open(cachePath, cacheSize * 1024 * 1024)) {
+			std::cerr << "Failed to open cache directory!" << std::endl;
+			return -1;
+		}
+		options.cache = &cache;
+	}
+
+	//The server runs until it is killed and the client only sends requests, there is nothing for them to report
+	if ((command == "-serve" || command == "-client") && (statsEnabled || traceEnabled)) {
+		std::cerr << "--stats and --trace are not supported with " << command << "!" << std::endl;
+		return -1;
+	}
+
+	//Answer conversion requests on a Unix domain socket until stopped
+	if (command == "-serve") {
+		return runServer(filePath, options.threads, options.cache) ? 0 : -1;
+	}
+	//Convert a file through a running server
+	if (command == "-client") {
+		return runClient(filePath, argv[3], options.encode, inlineFile, repeat) ? 0 : -1;
+	}
+
+	//Convert a directory, glob pattern or list of files in one process
+	if (command == "-batch") {
+		std::optional<std::vector<std::string>> files = collectBatchFiles(filePath);
+		if (!files.has_value()) {
+			return -1;
+		}
+		bool result = runBatch(files.value(), options, false);
+		if (traceEnabled && !writeTraceFile(tracePath)) {
+			std::cerr << "Failed to write trace file!" << std::endl;
+		}
+		return result ? 0 : -1;
+	}
+
+	//Verify a file, directory, glob pattern or list of files without making JPEG files
+	if (command == "-validate") {
+		std::error_code error;
+		std::optional<std::vector<std::string>> files;
+		if (std::filesystem::is_regular_file(filePath, error)) {
+			files = std::vector<std::string>{ filePath };
+		}
+		else {
+			files = collectBatchFiles(filePath);
+		}
+		if (!files.has_value()) {
+			return -1;
+		}
+		bool result = runBatch(files.value(), options, true);
+		if (traceEnabled && !writeTraceFile(tracePath)) {
+			std::cerr << "Failed to write trace file!" << std::endl;
+		}
+		return result ? 0 : -1;
+	}
+
 	//Check the lengths of the arguments
 	if (command.length() != 5 || filePath.length() > 260 || filePath.length() < 6) {
 		std::cerr << "Invalid parameters!" << std::endl;
@@ -530,44 +2203,31 @@ int main(int argc, char* argv[])
 	fileName = path.filename().string();
 
 	//Check for CIFF or CAFF file
+	bool result = false;
 	if (command == "-caff" && fileName.substr(fileName.length() - 5) == ".caff") {
 		//Get the name of the file
 		fileName = fileName.substr(0, fileName.length() - 5);
-		//Try to open the file
-		std::ifstream file(filePath, std::ios::binary);
-		if (!file) {
-			std::cerr << "Failed to open file!" << std::endl;
-			return -1;
-		}
 		//Read the CAFF file and make the JPEG
-		if (!readCAFFFile(file, fileName)) {
-			file.close();
-			return -1;
-		}
-		//Close the file
-		file.close();
+		size_t frames = 0;
+		result = convertFile(filePath, fileName, InputType::caff, options, frames);
 	}
 	else if (command == "-ciff" && fileName.substr(fileName.length() - 5) == ".ciff") {
 		//Get the name of the file
 		fileName = fileName.substr(0, fileName.length() - 5);
-		//Try to open the file
-		std::ifstream file(filePath, std::ios::binary);
-		if (!file) {
-			std::cerr << "Failed to open file!" << std::endl;
-			return -1;
-		}
 		//Read the CIFF file and make the JPEG
-		if (!readCIFFFile(file, fileName)) {
-			std::cerr << "Failed to parse CIFF file!" << std::endl;
-			file.close();
-			return -1;
-		}
-		//Close the file
-		file.close();
+		size_t frames = 0;
+		result = convertFile(filePath, fileName, InputType::ciff, options, frames);
 	}
 	else {
 		std::cerr << "Invalid parameters!" << std::endl;
 		return -1;
 	}
-	return 0;
+	//The stats of a failed conversion are printed too, they show how far it got
+	if (statsEnabled) {
+		std::cout << "{\"stats\":" << statsJSON(collectStats()) << "}" << std::endl;
+	}
+	if (traceEnabled && !writeTraceFile(tracePath)) {
+		std::cerr << "Failed to write trace file!" << std::endl;
+	}
+	return result ? 0 : -1;
 }
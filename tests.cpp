@@ -0,0 +1,721 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include "stb_image_write.h"
+#include "caff.h"
+
+//Regression tests of the encoder, run by make test
+//Every test prints one line with its result, the exit code is 1 if any of them failed
+
+//stbi_write_func that appends to a byte vector
+void appendBytes(void* context, void* data, int size) {
+	std::vector<unsigned char>* bytes = static_cast<std::vector<unsigned char>*>(context);
+	bytes->insert(bytes->end(), static_cast<unsigned char*>(data), static_cast<unsigned char*>(data) + size);
+}
+
+//Small deterministic random number generator for the test images
+class XorShift {
+public:
+	explicit XorShift(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+	uint32_t next() {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return uint32_t(state >> 32);
+	}
+
+private:
+	uint64_t state;
+};
+
+//Test image of width * height pixels with comp components
+//Kinds: 0 noise, 1 smooth gradients, 2 hard edged 8x8 checkerboard
+std::vector<unsigned char> testImage(int width, int height, int comp, int kind, uint64_t seed) {
+	XorShift random(seed);
+	std::vector<unsigned char> pixels(size_t(width) * height * comp);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			for (int c = 0; c < comp; c++) {
+				int value;
+				if (kind == 0) {
+					value = random.next() & 255;
+				}
+				else if (kind == 1) {
+					value = (x * (c + 1) * 255 / width + y * 255 / height) / 2;
+				}
+				else {
+					value = ((x / 8 + y / 8 + c) & 1) ? 230 : 20;
+				}
+				pixels[(size_t(y) * width + x) * comp + c] = (unsigned char)value;
+			}
+		}
+	}
+	return pixels;
+}
+
+//Minimal baseline JPEG decoder for the tests, it reads what stb_image_write makes: 8-bit samples, three components
+//with 1x1 or 2x2 sampled luma and 1x1 chroma, Huffman coding and optional restart markers
+//The chroma is upsampled by repeating it and the inverse DCT is the exact float one, so the pixels are those of the file
+class JPEGDecoder {
+public:
+	//Decode the file into width * height RGB pixels, returns false on anything it doesn't read
+	bool decode(const std::vector<unsigned char>& jpeg, int& width, int& height, std::vector<unsigned char>& rgb);
+
+private:
+	//Canonical Huffman table as in Annex F of the standard
+	struct HuffmanTable {
+		int maxCode[17];
+		int valueOffset[17];
+		std::vector<unsigned char> values;
+	};
+	struct Component {
+		int id;
+		int h;
+		int v;
+		int quant;
+		int dcTable;
+		int acTable;
+		int predictor;
+		//Width of the plane in samples, a whole number of MCUs
+		int stride;
+		std::vector<unsigned char> plane;
+	};
+
+	//Next bit of the entropy coded data, a marker reads as zero bits
+	int bit();
+	int receive(int bits);
+	//Next Huffman coded symbol, -1 if no code matches
+	int decodeSymbol(const HuffmanTable& table);
+	//Decode an 8x8 block into the plane of the component at (x, y)
+	bool decodeBlock(Component& component, int x, int y);
+
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+	size_t position = 0;
+	int bitBuffer = 0;
+	int bitCount = 0;
+	int quant[4][64] = {};
+	HuffmanTable huffman[2][4];
+	std::vector<Component> components;
+};
+
+//Natural order index of the coefficients in zigzag order
+static const int zigzag[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+int JPEGDecoder::bit() {
+	if (bitCount == 0) {
+		bitBuffer = 0;
+		if (position < size) {
+			if (data[position] != 0xFF) {
+				bitBuffer = data[position++];
+			}
+			else if (position + 1 < size && data[position + 1] == 0) {
+				bitBuffer = 0xFF;
+				position += 2;
+			}
+		}
+		bitCount = 8;
+	}
+	bitCount--;
+	return (bitBuffer >> bitCount) & 1;
+}
+
+int JPEGDecoder::receive(int bits) {
+	int value = 0;
+	for (int i = 0; i < bits; i++) {
+		value = value * 2 + bit();
+	}
+	//Values with a leading zero bit are negative
+	if (bits > 0 && value < (1 << (bits - 1))) {
+		value -= (1 << bits) - 1;
+	}
+	return value;
+}
+
+int JPEGDecoder::decodeSymbol(const HuffmanTable& table) {
+	int code = 0;
+	for (int length = 1; length <= 16; length++) {
+		code = code * 2 + bit();
+		if (code <= table.maxCode[length]) {
+			return table.values[size_t(table.valueOffset[length] + code)];
+		}
+	}
+	return -1;
+}
+
+bool JPEGDecoder::decodeBlock(Component& component, int x, int y) {
+	double coefficients[64] = {};
+	int symbol = decodeSymbol(huffman[0][component.dcTable]);
+	if (symbol < 0 || symbol > 11) {
+		return false;
+	}
+	component.predictor += receive(symbol);
+	coefficients[0] = component.predictor * quant[component.quant][0];
+	for (int k = 1; k < 64;) {
+		symbol = decodeSymbol(huffman[1][component.acTable]);
+		if (symbol < 0) {
+			return false;
+		}
+		int run = symbol >> 4;
+		int bits = symbol & 15;
+		if (bits == 0) {
+			//End of block, or a run of 16 zeros
+			if (run != 15) {
+				break;
+			}
+			k += 16;
+			continue;
+		}
+		k += run;
+		if (k > 63) {
+			return false;
+		}
+		coefficients[zigzag[k]] = receive(bits) * quant[component.quant][k];
+		k++;
+	}
+
+	//Exact inverse DCT
+	static double cosines[8][8];
+	static bool cosinesMade = false;
+	if (!cosinesMade) {
+		for (int i = 0; i < 8; i++) {
+			for (int u = 0; u < 8; u++) {
+				cosines[i][u] = (u == 0 ? std::sqrt(0.5) : 1.0) * std::cos((2 * i + 1) * u * 3.14159265358979323846 / 16);
+			}
+		}
+		cosinesMade = true;
+	}
+	for (int row = 0; row < 8; row++) {
+		for (int column = 0; column < 8; column++) {
+			double sum = 0;
+			for (int v = 0; v < 8; v++) {
+				for (int u = 0; u < 8; u++) {
+					sum += cosines[column][u] * cosines[row][v] * coefficients[v * 8 + u];
+				}
+			}
+			long value = std::lround(sum / 4 + 128);
+			component.plane[size_t(y + row) * component.stride + x + column] = (unsigned char)std::clamp(value, 0L, 255L);
+		}
+	}
+	return true;
+}
+
+bool JPEGDecoder::decode(const std::vector<unsigned char>& jpeg, int& width, int& height, std::vector<unsigned char>& rgb) {
+	data = jpeg.data();
+	size = jpeg.size();
+	components.clear();
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+		return false;
+	}
+	position = 2;
+	int restartInterval = 0;
+	width = 0;
+	height = 0;
+	//Read the segments up to the start of the scan
+	while (true) {
+		if (position + 4 > size || data[position] != 0xFF) {
+			return false;
+		}
+		int marker = data[position + 1];
+		size_t length = size_t(data[position + 2]) << 8 | data[position + 3];
+		size_t segment = position + 4;
+		size_t end = position + 2 + length;
+		if (length < 2 || end > size) {
+			return false;
+		}
+		if (marker == 0xDB) {
+			//Quantisation tables, 8-bit, in zigzag order
+			while (segment + 65 <= end) {
+				int table = data[segment] & 3;
+				for (int k = 0; k < 64; k++) {
+					quant[table][k] = data[segment + 1 + k];
+				}
+				segment += 65;
+			}
+		}
+		else if (marker == 0xC0) {
+			height = int(data[segment + 1]) << 8 | data[segment + 2];
+			width = int(data[segment + 3]) << 8 | data[segment + 4];
+			if (data[segment] != 8 || data[segment + 5] != 3) {
+				return false;
+			}
+			for (int i = 0; i < 3; i++) {
+				const unsigned char* spec = data + segment + 6 + i * 3;
+				components.push_back({ spec[0], spec[1] >> 4, spec[1] & 15, spec[2] & 3, 0, 0, 0, 0, {} });
+			}
+		}
+		else if (marker == 0xC4) {
+			while (segment + 17 <= end) {
+				HuffmanTable& table = huffman[data[segment] >> 4 & 1][data[segment] & 3];
+				const unsigned char* counts = data + segment + 1;
+				int code = 0;
+				int offset = 0;
+				for (int length = 1; length <= 16; length++) {
+					table.valueOffset[length] = offset - code;
+					code += counts[length - 1];
+					offset += counts[length - 1];
+					table.maxCode[length] = counts[length - 1] > 0 ? code - 1 : -1;
+					code <<= 1;
+				}
+				table.values.assign(data + segment + 17, data + segment + 17 + offset);
+				segment += 17 + size_t(offset);
+			}
+		}
+		else if (marker == 0xDD) {
+			restartInterval = int(data[segment]) << 8 | data[segment + 1];
+		}
+		else if (marker == 0xDA) {
+			if (components.size() != 3 || data[segment] != 3) {
+				return false;
+			}
+			for (int i = 0; i < 3; i++) {
+				components[i].dcTable = data[segment + 2 + i * 2] >> 4 & 3;
+				components[i].acTable = data[segment + 2 + i * 2] & 3;
+			}
+			position = end;
+			break;
+		}
+		position = end;
+	}
+
+	//Decode the MCUs into the planes of the components
+	int maxH = std::max({ components[0].h, components[1].h, components[2].h });
+	int maxV = std::max({ components[0].v, components[1].v, components[2].v });
+	int mcusX = (width + 8 * maxH - 1) / (8 * maxH);
+	int mcusY = (height + 8 * maxV - 1) / (8 * maxV);
+	for (Component& component : components) {
+		component.stride = mcusX * component.h * 8;
+		component.plane.assign(size_t(component.stride) * mcusY * component.v * 8, 0);
+	}
+	bitCount = 0;
+	for (int mcu = 0; mcu < mcusX * mcusY; mcu++) {
+		if (restartInterval > 0 && mcu > 0 && mcu % restartInterval == 0) {
+			//The bits left before a restart marker are padding
+			bitCount = 0;
+			if (position + 2 > size || data[position] != 0xFF || (data[position + 1] & 0xF8) != 0xD0) {
+				return false;
+			}
+			position += 2;
+			for (Component& component : components) {
+				component.predictor = 0;
+			}
+		}
+		for (Component& component : components) {
+			for (int v = 0; v < component.v; v++) {
+				for (int h = 0; h < component.h; h++) {
+					if (!decodeBlock(component, ((mcu % mcusX) * component.h + h) * 8, ((mcu / mcusX) * component.v + v) * 8)) {
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	//JFIF YCbCr to RGB
+	rgb.resize(size_t(width) * height * 3);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			double samples[3];
+			for (int i = 0; i < 3; i++) {
+				const Component& component = components[i];
+				samples[i] = component.plane[size_t(y * component.v / maxV) * component.stride + x * component.h / maxH];
+			}
+			double colors[3] = { samples[0] + 1.402 * (samples[2] - 128), samples[0] - 0.344136 * (samples[1] - 128) - 0.714136 * (samples[2] - 128),
+				samples[0] + 1.772 * (samples[1] - 128) };
+			for (int c = 0; c < 3; c++) {
+				rgb[(size_t(y) * width + x) * 3 + c] = (unsigned char)std::clamp(std::lround(colors[c]), 0L, 255L);
+			}
+		}
+	}
+	return true;
+}
+
+//Peak signal to noise ratio of the decoded pixels in dB, 99 for identical pixels
+double psnr(const std::vector<unsigned char>& original, const std::vector<unsigned char>& decoded) {
+	double error = 0;
+	for (size_t i = 0; i < original.size(); i++) {
+		double difference = double(original[i]) - double(decoded[i]);
+		error += difference * difference;
+	}
+	error /= double(original.size());
+	return error == 0 ? 99 : 10 * std::log10(255.0 * 255.0 / error);
+}
+
+//The integer DCT may lose only a little PSNR against the float DCT on the same images
+//The bounds are those documented in stb_image_write.h: about 0.1 dB on average, and about 1 dB at the high qualities
+bool testIntegerDCTPSNR() {
+	const double maxMeanLoss = 0.25;
+	const double maxLoss = 1.5;
+	const int sizes[][2] = { { 7, 9 }, { 67, 45 }, { 17, 33 }, { 640, 480 } };
+	JPEGDecoder decoder;
+	int cases = 0;
+	int failures = 0;
+	double totalLoss = 0;
+	double worstLoss = 0;
+	for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++) {
+		for (int kind = 0; kind < 3; kind++) {
+			int width = sizes[size][0];
+			int height = sizes[size][1];
+			std::vector<unsigned char> pixels = testImage(width, height, 3, kind, size * 4 + kind);
+			for (int quality : { 1, 25, 50, 75, 90, 100 }) {
+				for (int subsample = 0; subsample <= 1; subsample++) {
+					double results[2];
+					for (int integer = 0; integer <= 1; integer++) {
+						stbi_write_jpg_context context;
+						stbi_write_jpg_context_init_ex(&context, quality, subsample);
+						context.integer_dct = integer;
+						std::vector<unsigned char> jpeg;
+						std::vector<unsigned char> decoded;
+						int decodedWidth;
+						int decodedHeight;
+						if (!stbi_write_jpg_to_func_ctx(&appendBytes, &jpeg, width, height, 3, pixels.data(), &context) ||
+							!decoder.decode(jpeg, decodedWidth, decodedHeight, decoded) || decodedWidth != width || decodedHeight != height) {
+							std::cout << "  undecodable: " << width << "x" << height << " kind " << kind << " quality " << quality << " subsample " << subsample
+								<< " integer " << integer << std::endl;
+							results[integer] = 0;
+							continue;
+						}
+						results[integer] = psnr(pixels, decoded);
+					}
+					double loss = results[0] - results[1];
+					cases++;
+					totalLoss += loss;
+					worstLoss = std::max(worstLoss, loss);
+					if (results[0] == 0 || results[1] == 0 || loss > maxLoss) {
+						failures++;
+						std::cout << "  " << width << "x" << height << " kind " << kind << " quality " << quality << " subsample " << subsample
+							<< ": float " << results[0] << " dB, integer " << results[1] << " dB" << std::endl;
+					}
+				}
+			}
+		}
+	}
+	double meanLoss = totalLoss / cases;
+	bool passed = failures == 0 && meanLoss <= maxMeanLoss;
+	std::cout << (passed ? "ok" : "FAILED") << " integer_dct_psnr: " << cases << " images, mean loss " << meanLoss << " dB (at most " << maxMeanLoss
+		<< "), worst " << worstLoss << " dB (at most " << maxLoss << ")" << std::endl;
+	return passed;
+}
+
+//The SIMD colour conversion and DCT have to give the same bytes as the scalar code, on the float and the integer path
+//Levels above what the CPU supports run the best level it has
+bool testSIMDIdentical() {
+	const int sizes[][2] = { { 1, 1 }, { 7, 9 }, { 16, 16 }, { 67, 45 }, { 300, 199 } };
+	int cases = 0;
+	int mismatches = 0;
+	for (size_t size = 0; size < sizeof(sizes) / sizeof(sizes[0]); size++) {
+		for (int comp = 1; comp <= 4; comp++) {
+			for (int kind = 0; kind < 3; kind++) {
+				std::vector<unsigned char> pixels = testImage(sizes[size][0], sizes[size][1], comp, kind, size * 16 + comp * 4 + kind);
+				for (int quality : { 10, 75, 95 }) {
+					for (int options = 0; options < 8; options++) {
+						stbi_write_jpg_context context;
+						stbi_write_jpg_context_init_ex(&context, quality, options & 1);
+						context.integer_dct = (options >> 1) & 1;
+						context.optimize_huffman = (options >> 2) & 1;
+						std::vector<unsigned char> outputs[3];
+						for (int level = 0; level < 3; level++) {
+							stbi_write_jpg_simd_level = level;
+							stbi_write_jpg_to_func_ctx(&appendBytes, &outputs[level], sizes[size][0], sizes[size][1], comp, pixels.data(), &context);
+						}
+						stbi_write_jpg_simd_level = -1;
+						cases++;
+						if (outputs[0].empty() || outputs[1] != outputs[0] || outputs[2] != outputs[0]) {
+							mismatches++;
+							std::cout << "  mismatch: " << sizes[size][0] << "x" << sizes[size][1] << " comp " << comp << " kind " << kind
+								<< " quality " << quality << " subsample " << (options & 1) << " integer " << ((options >> 1) & 1)
+								<< " optimized " << ((options >> 2) & 1) << std::endl;
+						}
+					}
+				}
+			}
+		}
+	}
+	std::cout << (mismatches == 0 ? "ok" : "FAILED") << " simd_identical: " << cases << " images, " << mismatches << " differ between SIMD levels" << std::endl;
+	return mismatches == 0;
+}
+
+//CIFF file of the RGB pixels, with an empty caption and the tag "t"
+std::vector<unsigned char> ciffFile(int width, int height, const std::vector<unsigned char>& pixels) {
+	std::vector<unsigned char> file = { 'C', 'I', 'F', 'F' };
+	for (uint64_t field : { uint64_t(39), uint64_t(pixels.size()), uint64_t(width), uint64_t(height) }) {
+		for (int i = 0; i < 8; i++) {
+			file.push_back((unsigned char)(field >> (8 * i)));
+		}
+	}
+	file.insert(file.end(), { '\n', 't', '\0' });
+	file.insert(file.end(), pixels.begin(), pixels.end());
+	return file;
+}
+
+void writeFile(const std::filesystem::path& path, const std::vector<unsigned char>& bytes) {
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+}
+
+std::vector<unsigned char> readFile(const std::filesystem::path& path) {
+	std::ifstream in(path, std::ios::binary);
+	return std::vector<unsigned char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+//The SSE2 and AVX2 scans of the CIFF caption and tags have to agree with reading them byte by byte
+//Every length up to 100 is tried at four alignments, so the vector loops, their tails and a vector per loop are all covered
+bool testCIFFTagScan() {
+	XorShift random(20);
+	int cases = 0;
+	int mismatches = 0;
+	std::vector<std::string_view> split;
+	std::vector<std::string_view> parsed;
+	for (size_t length = 0; length <= 100; length++) {
+		for (int kind = 0; kind < 5; kind++) {
+			for (size_t offset = 0; offset < 4; offset++) {
+				//0 short tags, 1 only '\0' bytes, 2 no '\0' at all, 3 tags without a closing '\0', 4 a few '\n' as well
+				std::string text(offset + length, 'x');
+				for (size_t i = offset; i < text.size(); i++) {
+					uint32_t value = random.next() % 8;
+					text[i] = kind == 1 || (kind != 2 && value < 3) ? '\0' : kind == 4 && value == 3 ? '\n' : char('a' + value);
+				}
+				if (kind == 3 && length > 0) {
+					text.back() = 'z';
+				}
+				std::string_view view = std::string_view(text).substr(offset);
+
+				//Splitting the tags
+				std::vector<std::string_view> expected;
+				std::string_view rest = view;
+				std::string_view tag;
+				while (nextCIFFTag(rest, tag)) {
+					expected.push_back(tag);
+				}
+				splitCIFFTags(view, split);
+				cases++;
+				if (split != expected) {
+					mismatches++;
+					std::cout << "  splitCIFFTags differs: length " << length << " kind " << kind << " offset " << offset << std::endl;
+				}
+
+				//Parsing the text as the caption and tags of a 1x1 CIFF, the caption is closed anywhere in it
+				if (length < 2) {
+					continue;
+				}
+				std::string header(view);
+				if (kind != 4) {
+					header[random.next() % length] = '\n';
+				}
+				std::vector<unsigned char> file = ciffFile(1, 1, { 1, 2, 3 });
+				uint64_t headerSize = 36 + length;
+				for (int i = 0; i < 8; i++) {
+					file[4 + i] = (unsigned char)(headerSize >> (8 * i));
+				}
+				file.erase(file.begin() + 36, file.end() - 3);
+				file.insert(file.begin() + 36, header.begin(), header.end());
+				size_t captionEnd = header.find('\n');
+				CAFFError expectedError = captionEnd == std::string::npos ? CAFFError::captionNotTerminated
+					: header.find('\n', captionEnd + 1) != std::string::npos ? CAFFError::tagNewline : CAFFError::none;
+				expected.clear();
+				if (expectedError == CAFFError::none) {
+					rest = std::string_view(header).substr(captionEnd + 1);
+					while (nextCIFFTag(rest, tag)) {
+						expected.push_back(tag);
+					}
+				}
+				CIFFImage image;
+				CAFFError error = parseCIFF(file.data(), file.size(), image, &parsed);
+				cases++;
+				if (error != expectedError || (error == CAFFError::none && (image.caption.size() != captionEnd || parsed.size() != expected.size() ||
+					!std::equal(parsed.begin(), parsed.end(), expected.begin())))) {
+					mismatches++;
+					std::cout << "  parseCIFF differs: length " << length << " kind " << kind << " offset " << offset << std::endl;
+				}
+			}
+		}
+	}
+	std::cout << (mismatches == 0 ? "ok" : "FAILED") << " ciff_tag_scan: " << cases << " texts, " << mismatches << " differ from nextCIFFTag" << std::endl;
+	return mismatches == 0;
+}
+
+//Run ./parser with the arguments in the directory, its output is discarded
+bool runParser(const std::filesystem::path& directory, const std::string& arguments) {
+	std::string command = "cd '" + directory.string() + "' && '" + std::filesystem::absolute("parser").string() + "' " + arguments + " > /dev/null 2>&1";
+	return std::system(command.c_str()) == 0;
+}
+
+//The result cache of the parser evicts the least recently used entries down to 90% of its size, a cache hit counts as a use
+//Runs ./parser on images in a temporary directory with a 1 MiB cache filled with entries of known ages
+bool testCacheEviction() {
+	namespace fs = std::filesystem;
+	const uint64_t limit = 1 << 20;
+	const int fakes = 10;
+	fs::path directory = fs::temp_directory_path() / ("caff_tests_" + std::to_string(getpid()));
+	fs::path cache = directory / "cache";
+	fs::remove_all(directory);
+	fs::create_directories(cache);
+	auto now = fs::file_time_type::clock::now();
+	std::string failure;
+
+	//Two noise images that encode to a few ten KB
+	for (int image = 0; image < 2; image++) {
+		writeFile(directory / (image == 0 ? "a.ciff" : "b.ciff"), ciffFile(300, 300, testImage(300, 300, 3, 0, 1000 + image)));
+	}
+	auto convert = [&](const char* name) { return runParser(directory, std::string("-ciff ") + name + " --cache cache --cache-size 1"); };
+	auto fakePath = [&](int index) { return cache / ("fake" + std::to_string(index) + ".jpg"); };
+	//Entries in the cache directory and their total size
+	auto listCache = [&](uint64_t& total) {
+		std::vector<std::string> names;
+		total = 0;
+		for (const fs::directory_entry& file : fs::directory_iterator(cache)) {
+			names.push_back(file.path().filename().string());
+			total += file.file_size();
+		}
+		return names;
+	};
+
+	//Entries of 104000 bytes used 10 to 1 hours ago, fake0 the oldest, that fill the cache to 8 KB below the limit,
+	//and temporary files of a dead and of a live writer
+	for (int i = 0; i < fakes; i++) {
+		writeFile(fakePath(i), std::vector<unsigned char>(104000, (unsigned char)i));
+		fs::last_write_time(fakePath(i), now - std::chrono::hours(fakes - i));
+	}
+	writeFile(cache / "dead.jpg.tmp1_1", std::vector<unsigned char>(10, 0));
+	fs::last_write_time(cache / "dead.jpg.tmp1_1", now - std::chrono::hours(2));
+	writeFile(cache / "live.jpg.tmp1_1", std::vector<unsigned char>(10, 0));
+
+	//Storing the first image takes the cache over the limit
+	uint64_t total = 0;
+	std::string entryA;
+	int evicted = 0;
+	if (!convert("a.ciff")) {
+		failure = "conversion failed";
+	}
+	else {
+		for (const std::string& name : listCache(total)) {
+			if (name.find("fake") == std::string::npos && name.find(".tmp") == std::string::npos) {
+				entryA = name;
+			}
+		}
+		total -= 10;
+		while (evicted < fakes && !fs::exists(fakePath(evicted))) {
+			evicted++;
+		}
+		for (int i = evicted; i < fakes; i++) {
+			if (!fs::exists(fakePath(i))) {
+				failure = "fake" + std::to_string(i) + " evicted before an older entry";
+			}
+		}
+		if (entryA.empty()) {
+			failure = "the new entry is missing";
+		}
+		else if (evicted == 0 || evicted == fakes) {
+			failure = std::to_string(evicted) + " entries evicted";
+		}
+		else if (total > limit / 10 * 9) {
+			failure = "evicted down to " + std::to_string(total) + " bytes";
+		}
+		else if (fs::exists(cache / "dead.jpg.tmp1_1") || !fs::exists(cache / "live.jpg.tmp1_1")) {
+			failure = "wrong temporary files removed";
+		}
+	}
+
+	//A hit on the first image makes it the most recently used, so the next eviction removes the fakes before it
+	if (failure.empty()) {
+		std::vector<unsigned char> stored = readFile(directory / "a.jpg");
+		fs::last_write_time(cache / entryA, now - std::chrono::hours(fakes + 10));
+		fs::remove(directory / "a.jpg");
+		if (!convert("a.ciff") || readFile(directory / "a.jpg") != stored) {
+			failure = "the cached image differs from the encoded one";
+		}
+		else {
+			writeFile(cache / "fill.jpg", std::vector<unsigned char>(300000, 0));
+			fs::last_write_time(cache / "fill.jpg", now - std::chrono::minutes(30));
+			bool converted = convert("b.ciff");
+			listCache(total);
+			total -= 10;
+			if (!converted) {
+				failure = "conversion failed";
+			}
+			else if (!fs::exists(cache / entryA)) {
+				failure = "the entry of a cache hit was evicted";
+			}
+			else if (fs::exists(fakePath(evicted))) {
+				failure = "the oldest entry was not evicted";
+			}
+			else if (total > limit / 10 * 9) {
+				failure = "evicted down to " + std::to_string(total) + " bytes";
+			}
+		}
+	}
+	fs::remove_all(directory);
+
+	if (failure.empty()) {
+		std::cout << "ok cache_eviction: " << evicted << " of " << fakes << " entries evicted oldest first, hit entry kept" << std::endl;
+	}
+	else {
+		std::cout << "FAILED cache_eviction: " << failure << std::endl;
+	}
+	return failure.empty();
+}
+
+//A cache hit has to give the bytes the encoder would make with the same options, and an image encoded on more than
+//one thread has restart bands that one encoded on a single thread doesn't
+bool testCacheThreads() {
+	namespace fs = std::filesystem;
+	fs::path directory = fs::temp_directory_path() / ("caff_tests_" + std::to_string(getpid()));
+	fs::remove_all(directory);
+	fs::create_directories(directory);
+	//Tall enough for four bands of at least 2^18 pixels
+	writeFile(directory / "y.ciff", ciffFile(1024, 1024, testImage(1024, 1024, 3, 1, 2000)));
+	//The image the parser makes with the arguments, empty if it fails
+	auto convert = [&](const std::string& arguments) {
+		fs::remove(directory / "y.jpg");
+		return runParser(directory, "-ciff y.ciff " + arguments) ? readFile(directory / "y.jpg") : std::vector<unsigned char>();
+	};
+
+	std::string failure;
+	std::vector<unsigned char> single = convert("");
+	std::vector<unsigned char> banded = convert("--threads 4");
+	if (single.empty() || banded.empty()) {
+		failure = "conversion failed";
+	}
+	else if (single == banded) {
+		failure = "the image is not encoded in bands";
+	}
+	//Fill the cache on one thread, then ask for the banded image twice: a miss and then a hit
+	else if (convert("--cache cache") != single) {
+		failure = "the cached single thread image differs";
+	}
+	else if (convert("--cache cache --threads 4") != banded || convert("--cache cache --threads 4") != banded) {
+		failure = "the cached banded image differs from the encoded one";
+	}
+	else if (convert("--cache cache") != single) {
+		failure = "the single thread image was replaced by the banded one";
+	}
+	fs::remove_all(directory);
+
+	if (failure.empty()) {
+		std::cout << "ok cache_threads: single thread and banded images are cached apart" << std::endl;
+	}
+	else {
+		std::cout << "FAILED cache_threads: " << failure << std::endl;
+	}
+	return failure.empty();
+}
+
+int main() {
+	bool passed = true;
+	passed = testSIMDIdentical() && passed;
+	passed = testIntegerDCTPSNR() && passed;
+	passed = testCIFFTagScan() && passed;
+	passed = testCacheEviction() && passed;
+	passed = testCacheThreads() && passed;
+	return passed ? 0 : 1;
+}